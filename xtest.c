@@ -2,546 +2,4901 @@
  * xtest_simulator.c
  *
  * An XTest + ncurses program that:
- *  - Has 4 fields: [Text to type], [Start Delay], [Loop Delay], [Loops]
+ *  - Has fields: [Text to type], [Start Delay], [Loop Delay], [Loops],
+ *    plus [Rate], [Dwell], [Flight] and [Batch] for timing
  *  - Supports special tokens: {enter}, {space}, {up}, etc. (with optional :ms hold)
- *  - Loads lines from messages.txt for {messageN}
- *  - F1 => reset fields, F2 => stop typing mid-run
+ *  - Maps messages.txt for {messageN} (lines indexed lazily, no limits)
+ *    and reloads it on change (inotify + snapshot swap of a private copy)
+ *  - F1 => reset fields, F2 => stop typing mid-run, F3 => dump the plan,
+ *    F4 => cycle the log level (--log-level sets it at startup)
+ *  - The text is compiled once into an event plan that every loop replays
+ *  - Typing runs on an engine thread fed by a lock-free command queue, so
+ *    the UI stays live mid-run (F6 => pause/resume, Enter => apply Rate)
+ *  - A status pane shows loop, keys, token, cps and ETA at --fps frames/s
  *  - Logs to an ncurses ring-buffer AND appends to logsXtest.txt
+ *    (from a writer thread, so the typing loop never waits on the disk)
+ *  - --binary-log keeps raw log arguments and formats them only for display;
+ *    --decode-log FILE turns a logsXtest.bin file back into text
+ *  - -DXTEST_NO_TRACE compiles out the per-key SIM trace lines
+ *  - --harness runs headless against a private Xvfb and reports timing
+ *    error and jitter from the key events captured through XRecord
+ *  - -DXTEST_BENCH adds --bench: ns/op and allocs/op for the hot paths,
+ *    with --bench-save / --bench-compare against a baseline file
  *
  * Compile:
- *    gcc -o xtest_simulator xtest_simulator.c -lX11 -lXtst -lncurses
+ *    gcc -o xtest_simulator xtest_simulator.c -lX11 -lXtst -lncurses -lpthread
  *
  * Run under X11. Press Tab to switch fields, Enter to type, F2 mid-run to stop, 
  * F1 to reset fields, Ctrl+C to quit.
  ****************************************************************************/
 
 #include <X11/Xlib.h>
+#include <X11/XKBlib.h>
 #include <X11/keysym.h>
 #include <X11/extensions/XTest.h>
+#include <X11/extensions/record.h>
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <signal.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+// ---------------------------------------------------------------------
+// Severity levels. Each LOG_* macro adds the line prefix and skips the
+// call entirely when its level is below the runtime threshold (F4).
+// Building with -DXTEST_NO_TRACE removes the per-keystroke TRACE_SIM
+// calls from the replay loops at compile time.
+// ---------------------------------------------------------------------
+enum {
+    LOG_LVL_SIM,
+    LOG_LVL_DEBUG,
+    LOG_LVL_INFO,
+    LOG_LVL_WARN,
+    LOG_LVL_ERROR,
+    LOG_LVL_COUNT
+};
+
+static const char *const g_logLevelNames[LOG_LVL_COUNT] = {
+    "SIM", "DEBUG", "INFO", "WARN", "ERROR"
+};
+
+static atomic_int g_logLevel = LOG_LVL_SIM;  // lowest level that gets logged
+static int        g_logEchoLevel = LOG_LVL_COUNT;  // headless: this and up also go to stderr
+
+static void add_log(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void add_log_always(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define LOG_ENABLED(lvl) ((lvl) >= atomic_load_explicit(&g_logLevel, memory_order_relaxed))
+#define LOG_AT(lvl, prefix, fmt, ...) \
+    do { if (LOG_ENABLED(lvl)) add_log((lvl), prefix fmt, ##__VA_ARGS__); } while (0)
+
+#define LOG_SIM(fmt, ...)   LOG_AT(LOG_LVL_SIM,   "SIM: ",   fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LVL_DEBUG, "DEBUG: ", fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...)  LOG_AT(LOG_LVL_INFO,  "INFO: ",  fmt, ##__VA_ARGS__)
+#define LOG_TIP(fmt, ...)   LOG_AT(LOG_LVL_INFO,  "TIP: ",   fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...)  LOG_AT(LOG_LVL_WARN,  "WARN: ",  fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LVL_ERROR, "ERROR: ", fmt, ##__VA_ARGS__)
+
+#ifdef XTEST_NO_TRACE
+#define TRACE_SIM(fmt, ...) \
+    do { if (0) add_log(LOG_LVL_SIM, fmt, ##__VA_ARGS__); } while (0)
+#else
+#define TRACE_SIM(fmt, ...) LOG_SIM(fmt, ##__VA_ARGS__)
+#endif
+
+// Parse a level name ("warn", "SIM", ...); -1 if unknown
+static int log_level_from_name(const char *name)
+{
+    for (int l = 0; l < LOG_LVL_COUNT; l++) {
+        if (strcasecmp(name, g_logLevelNames[l]) == 0) return l;
+    }
+    return -1;
+}
+
+// One on-screen log line. Text mode stores the formatted line; binary
+// mode stores the format ID and raw arguments and formats in draw_logs.
+typedef struct {
+    uint16_t fmtId;       // 0 => data is already text
+    uint16_t len;         // bytes used in data
+    char     data[252];
+} LogSlot;
+
 #define MAX_LOG_LINES 200
-static char g_logBuffer[MAX_LOG_LINES][256];
-static int  g_logHead = 0;
+#define LOG_LINE_MAX  512  // longest formatted line, NUL included
+// The UI and engine threads both log, and neither takes a lock for the
+// ring: a line claims the next sequence number, and slot seq % 200 is a
+// small seqlock. Its version is 2*seq+1 while line `seq` is being copied
+// in and 2*seq+2 once it is complete; draw_logs copies a slot out and
+// keeps it only if the version was complete and did not change.
+static LogSlot          g_logBuffer[MAX_LOG_LINES];
+static _Atomic uint64_t g_logSlotVer[MAX_LOG_LINES];
+static _Atomic uint64_t g_logSeq = 0;  // lines ever added
 
-// We'll keep a file handle for logsXtest.txt
+// We'll keep a file handle for logsXtest.txt (only the writer thread uses it)
 static FILE *g_fileLog = NULL;
+static int   g_logBinary = 0;  // --binary-log: logsXtest.bin with raw records
 
-/** Global stop flag for F2. When set, we abort mid-typing. */
+/** Stop flag for F2 (engine thread only). When set, we abort mid-typing. */
 static int  g_stopRequested = 0;
 
-/** For loading lines from messages.txt -> {messageN}. */
-#define MAX_MESSAGES 100
-static char *g_messages[MAX_MESSAGES];
-static int   g_messageCount = 0;
+/** messages.txt, a read-only snapshot for {messageN} (engine thread only). */
+typedef struct MessageOps MessageOps;
+typedef struct {
+    const char *base;       // the mapping or a private copy, NULL if empty
+    size_t      size;
+    size_t      mapSize;    // length of the mapping, 0 for a copy
+    int         fd;         // the mapped file (for size rechecks), -1 for a copy
+    size_t     *lineStart;  // offsets of the lines indexed so far
+    size_t      lineCount;
+    size_t      lineCap;
+    size_t      scanPos;    // the index covers base[0 .. scanPos)
+    MessageOps *opsTable;   // compiled lines, open addressing by line
+    size_t      opsCap;     // power of two
+    size_t      opsUsed;
+} MessageStore;
+
+
+
+// ---------------------------------------------------------------------
+// Deferred formatting (--binary-log)
+//   Every distinct format string gets a small ID the first time it is
+//   logged (looked up by the literal's address). A record is then just
+//   the ID, a timestamp and the raw arguments; printf-style formatting
+//   only happens when a line is drawn or a file is decoded.
+// ---------------------------------------------------------------------
+enum {
+    LOG_ARG_INT = 1,  // int (also %c, %u, %x, and a '*' width)
+    LOG_ARG_LONG,     // long
+    LOG_ARG_LLONG,    // long long
+    LOG_ARG_SIZE,     // size_t
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STR,      // copied into the record, at most LOG_STR_MAX bytes
+    LOG_ARG_PTR,
+    LOG_ARG_PREC      // int, a '*' precision; also caps the next %s copy
+};
+
+#define LOG_MAX_ARGS    8
+#define LOG_MAX_FORMATS 1024
+#define LOG_FMT_HASH    2048  // power of two, > LOG_MAX_FORMATS
+#define LOG_STR_MAX     200
+
+typedef struct {
+    const char *fmt;
+    int         nargs;
+    uint8_t     types[LOG_MAX_ARGS];
+} LogFormat;
+
+static LogFormat              g_logFormats[LOG_MAX_FORMATS];  // [0] unused
+static int                    g_logFormatCount = 1;
+static _Atomic(const char *)  g_logFmtKeys[LOG_FMT_HASH];
+static uint16_t               g_logFmtIds[LOG_FMT_HASH];
+static pthread_mutex_t        g_logFmtLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find the next conversion in `p`. Returns the '%' (NULL at the end) and
+// sets *specLen and *type (0 for "%%", -1 for anything we can't defer).
+// *stars gets the int arguments taken first: bit 0 for a '*' width,
+// bit 1 for a '*' precision.
+static const char *log_next_spec(const char *p, size_t *specLen, int *type, int *stars)
+{
+    p = strchr(p, '%');
+    if (!p) return NULL;
+
+    const char *q = p + 1;
+    *stars = 0;
+    if (*q == '%') {
+        *specLen = 2;
+        *type    = 0;
+        return p;
+    }
+    while (*q && strchr("-+ #0", *q)) q++;
+    if (*q == '*') {
+        *stars |= 1;
+        q++;
+    }
+    while (isdigit((unsigned char)*q)) q++;
+    if (*q == '.') {
+        q++;
+        if (*q == '*') {
+            *stars |= 2;
+            q++;
+        }
+        while (isdigit((unsigned char)*q)) q++;
+    }
+
+    int longs = 0, size = 0;
+    while (*q == 'l' || *q == 'z' || *q == 'h') {
+        if (*q == 'l') longs++;
+        if (*q == 'z') size = 1;
+        q++;
+    }
+
+    *type = -1;
+    if (*q && strchr("diouxXc", *q)) {
+        *type = size ? LOG_ARG_SIZE : longs >= 2 ? LOG_ARG_LLONG
+              : longs == 1 ? LOG_ARG_LONG : LOG_ARG_INT;
+    } else if (*q && strchr("fFeEgG", *q)) {
+        *type = LOG_ARG_DOUBLE;
+    } else if (*q == 's') {
+        *type = LOG_ARG_STR;
+    } else if (*q == 'p') {
+        *type = LOG_ARG_PTR;
+    }
+    *specLen = (size_t)(q - p) + (*q ? 1 : 0);
+    return p;
+}
+
+static int log_parse_format(const char *fmt, LogFormat *def)
+{
+    def->fmt   = fmt;
+    def->nargs = 0;
+
+    const char *p = fmt;
+    size_t      specLen;
+    int         type, stars;
+    while ((p = log_next_spec(p, &specLen, &type, &stars)) != NULL) {
+        int need = (type > 0) + (stars & 1) + (stars >> 1);
+        if (type < 0 || def->nargs + need > LOG_MAX_ARGS) return -1;
+        if (stars & 1) def->types[def->nargs++] = LOG_ARG_INT;
+        if (stars & 2) def->types[def->nargs++] = LOG_ARG_PREC;
+        if (type > 0)  def->types[def->nargs++] = (uint8_t)type;
+        p += specLen;
+    }
+    return 0;
+}
+
+// Format ID for `fmt`, registering it on first use. 0 => format eagerly.
+static int log_intern(const char *fmt)
+{
+    unsigned mask = LOG_FMT_HASH - 1;
+    unsigned h    = (unsigned)(((uintptr_t)fmt >> 3) * 2654435761u) & mask;
+
+    for (unsigned n = 0; n < LOG_FMT_HASH; n++) {
+        unsigned    i = (h + n) & mask;
+        const char *k = atomic_load_explicit(&g_logFmtKeys[i], memory_order_acquire);
+        if (k == fmt)  return g_logFmtIds[i];
+        if (k == NULL) break;
+    }
+
+    // Slow path, once per call site
+    pthread_mutex_lock(&g_logFmtLock);
+    int id = 0;
+    for (unsigned n = 0; n < LOG_FMT_HASH; n++) {
+        unsigned    i = (h + n) & mask;
+        const char *k = atomic_load_explicit(&g_logFmtKeys[i], memory_order_relaxed);
+        if (k == fmt) {
+            id = g_logFmtIds[i];
+            break;
+        }
+        if (k != NULL) continue;
+
+        if (g_logFormatCount < LOG_MAX_FORMATS
+            && log_parse_format(fmt, &g_logFormats[g_logFormatCount]) == 0)
+        {
+            id = g_logFormatCount++;
+        }
+        g_logFmtIds[i] = (uint16_t)id;
+        atomic_store_explicit(&g_logFmtKeys[i], fmt, memory_order_release);
+        break;
+    }
+    pthread_mutex_unlock(&g_logFmtLock);
+    return id;
+}
+
+// Serialize the arguments described by `def`. Returns bytes used.
+static size_t log_encode_args(const LogFormat *def, va_list args, char *out, size_t cap)
+{
+    size_t n    = 0;
+    long   prec = -1;  // a '*' precision bounds what %s may read
+    for (int a = 0; a < def->nargs; a++) {
+        int64_t  iv;
+        double   dv;
+        switch (def->types[a]) {
+        case LOG_ARG_PREC:   iv = prec = va_arg(args, int);                goto put_int;
+        case LOG_ARG_INT:    iv = va_arg(args, int);                       goto put_int;
+        case LOG_ARG_LONG:   iv = va_arg(args, long);                      goto put_int;
+        case LOG_ARG_LLONG:  iv = va_arg(args, long long);                 goto put_int;
+        case LOG_ARG_SIZE:   iv = (int64_t)va_arg(args, size_t);           goto put_int;
+        case LOG_ARG_PTR:    iv = (int64_t)(uintptr_t)va_arg(args, void *); goto put_int;
+        case LOG_ARG_DOUBLE:
+            dv = va_arg(args, double);
+            if (n + sizeof(dv) > cap) return n;
+            memcpy(out + n, &dv, sizeof(dv));
+            n += sizeof(dv);
+            break;
+        case LOG_ARG_STR: {
+            const char *str = va_arg(args, const char *);
+            if (!str) str = "(null)";
+            size_t   room = cap - n > sizeof(uint16_t) ? cap - n - sizeof(uint16_t) : 0;
+            size_t   sl   = strnlen(str, prec >= 0 && prec < LOG_STR_MAX ? (size_t)prec : LOG_STR_MAX);
+            uint16_t len  = (uint16_t)(sl < room ? sl : room);
+            if (n + sizeof(len) > cap) return n;
+            memcpy(out + n, &len, sizeof(len));
+            memcpy(out + n + sizeof(len), str, len);
+            n += sizeof(len) + len;
+            break;
+        }
+        }
+        prec = -1;
+        continue;
+
+    put_int:
+        if (def->types[a] != LOG_ARG_PREC) prec = -1;
+        if (n + sizeof(iv) > cap) return n;
+        memcpy(out + n, &iv, sizeof(iv));
+        n += sizeof(iv);
+    }
+    return n;
+}
+
+// printf `fmt` with arguments read back from a record. Used by draw_logs
+// and --decode-log, never on the typing path.
+static void log_format_args(const char *fmt, const char *args, size_t argLen,
+                            char *out, size_t outSize)
+{
+    size_t      o = 0, a = 0;
+    const char *p = fmt;
+    out[0] = '\0';
+
+    while (*p && o + 1 < outSize) {
+        size_t      specLen;
+        int         type, stars;
+        const char *spec = log_next_spec(p, &specLen, &type, &stars);
+        size_t      lit  = spec ? (size_t)(spec - p) : strlen(p);
+
+        if (lit > outSize - 1 - o) lit = outSize - 1 - o;
+        memcpy(out + o, p, lit);
+        o += lit;
+        out[o] = '\0';
+        if (!spec) break;
+
+        // The spec with each '*' replaced by the int recorded for it
+        char   one[48];
+        size_t ol = 0;
+        for (size_t i = 0; i < specLen && ol + 12 < sizeof(one); i++) {
+            if (spec[i] != '*') {
+                one[ol++] = spec[i];
+                continue;
+            }
+            int64_t sv = 0;
+            if (a + sizeof(sv) <= argLen) memcpy(&sv, args + a, sizeof(sv));
+            a += sizeof(sv);
+            if (sv < 0 && i > 0 && spec[i - 1] == '.') {
+                ol--;  // a negative precision means none
+            } else {
+                ol += (size_t)snprintf(one + ol, sizeof(one) - ol, "%d", (int)sv);
+            }
+        }
+        one[ol] = '\0';
+        char   conv = one[ol - 1];
+        int    w    = 0;
+        int64_t iv  = 0;
+
+        if (type == 0) {
+            w = snprintf(out + o, outSize - o, "%%");
+        } else if (type == LOG_ARG_STR) {
+            uint16_t len = 0;
+            if (a + sizeof(len) <= argLen) memcpy(&len, args + a, sizeof(len));
+            a += sizeof(len);
+            if (a + len > argLen) len = 0;
+            char str[LOG_STR_MAX + 1];
+            memcpy(str, args + a, len);
+            str[len] = '\0';
+            a += len;
+            w = snprintf(out + o, outSize - o, one, str);
+        } else if (a + 8 <= argLen) {
+            double dv;
+            memcpy(&iv, args + a, sizeof(iv));
+            memcpy(&dv, args + a, sizeof(dv));
+            a += 8;
+            int uns = strchr("ouxX", conv) != NULL;
+            switch (type) {
+            case LOG_ARG_INT:
+                w = uns ? snprintf(out + o, outSize - o, one, (unsigned)iv)
+                        : snprintf(out + o, outSize - o, one, (int)iv);
+                break;
+            case LOG_ARG_LONG:
+                w = uns ? snprintf(out + o, outSize - o, one, (unsigned long)iv)
+                        : snprintf(out + o, outSize - o, one, (long)iv);
+                break;
+            case LOG_ARG_LLONG:
+                w = uns ? snprintf(out + o, outSize - o, one, (unsigned long long)iv)
+                        : snprintf(out + o, outSize - o, one, (long long)iv);
+                break;
+            case LOG_ARG_SIZE:
+                w = snprintf(out + o, outSize - o, one, (size_t)iv);
+                break;
+            case LOG_ARG_DOUBLE:
+                w = snprintf(out + o, outSize - o, one, dv);
+                break;
+            case LOG_ARG_PTR:
+                w = snprintf(out + o, outSize - o, one, (void *)(uintptr_t)iv);
+                break;
+            }
+        }
+        if (w > 0) o += (size_t)w < outSize - o ? (size_t)w : outSize - 1 - o;
+        p = spec + specLen;
+    }
+}
+
+// Text of an on-screen slot, formatting it now if it was deferred
+static const char *log_slot_text(const LogSlot *slot, char *buf, size_t size)
+{
+    if (slot->fmtId == 0) return slot->data;
+    log_format_args(g_logFormats[slot->fmtId].fmt, slot->data, slot->len, buf, size);
+    return buf;
+}
+
+static int64_t wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------
+// Log file writer
+//   add_log only copies the line into a lock-free single producer /
+//   single consumer byte ring. The engine thread owns g_logQueueEngine,
+//   so a keystroke's log call never waits on anyone; the other threads
+//   share g_logQueue behind g_logQueueLock, held for one copy. A writer
+//   thread drains both to logsXtest.txt every g_logCommitMs, in the order
+//   the lines were logged, with one write + flush per batch. When a ring
+//   is full the line is dropped (and counted) instead of blocking the
+//   caller.
+//   In binary mode a queued record is [format ID][timestamp][raw args]
+//   and the file is a stream of tagged records:
+//     'S'                               session start, format IDs reset
+//     'F' u16 id, u16 len, fmt          format definition, before first use
+//     'R' u16 len, u16 id, i64 ns, args log record (id 0: args are text)
+// ---------------------------------------------------------------------
+#define LOG_BIN_MAGIC "XTLOGBIN1\n"
+#define LOG_QUEUE_SIZE (1 << 18)  // bytes, power of two
+
+typedef struct {
+    char                   buf[LOG_QUEUE_SIZE];
+    _Atomic size_t         head;     // total bytes written by the producer
+    _Atomic size_t         tail;     // total bytes consumed by the writer
+    _Atomic unsigned long  dropped;  // lines lost because the ring was full
+} LogQueue;
+
+static LogQueue        g_logQueue;        // UI and other threads
+static LogQueue        g_logQueueEngine;  // the engine thread only
+static pthread_mutex_t g_logQueueLock = PTHREAD_MUTEX_INITIALIZER;  // g_logQueue's producers
+static _Thread_local int t_logEngine;     // set on the engine thread
+static int         g_logCommitMs = 100;  // group-commit interval
+static pthread_t   g_logThread;
+static int         g_logThreadRunning = 0;
+static atomic_int  g_logThreadStop;
+
+static void log_queue_copy_in(LogQueue *q, size_t pos, const void *src, size_t len)
+{
+    size_t off   = pos & (LOG_QUEUE_SIZE - 1);
+    size_t first = LOG_QUEUE_SIZE - off < len ? LOG_QUEUE_SIZE - off : len;
+    memcpy(&q->buf[off], src, first);
+    memcpy(q->buf, (const char *)src + first, len - first);
+}
+
+static void log_queue_copy_out(LogQueue *q, size_t pos, void *dst, size_t len)
+{
+    size_t off   = pos & (LOG_QUEUE_SIZE - 1);
+    size_t first = LOG_QUEUE_SIZE - off < len ? LOG_QUEUE_SIZE - off : len;
+    memcpy(dst, &q->buf[off], first);
+    memcpy((char *)dst + first, q->buf, len - first);
+}
+
+// Producer side: one record = 2-byte length, the line's sequence number
+// (for the writer's merge, not written out) + text. Never blocks.
+static void log_queue_push(LogQueue *q, uint64_t seq, const char *line, size_t len)
+{
+    uint16_t n    = (uint16_t)len;
+    size_t   head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t   tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (LOG_QUEUE_SIZE - (head - tail) < sizeof(n) + sizeof(seq) + n) {
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    log_queue_copy_in(q, head, &n, sizeof(n));
+    log_queue_copy_in(q, head + sizeof(n), &seq, sizeof(seq));
+    log_queue_copy_in(q, head + sizeof(n) + sizeof(seq), line, n);
+    atomic_store_explicit(&q->head, head + sizeof(n) + sizeof(seq) + n, memory_order_release);
+}
+
+// Queue line `seq` for the writer thread, on the caller's own ring
+static void log_file_push(uint64_t seq, const char *line, size_t len)
+{
+    if (!g_logThreadRunning) return;
+    if (t_logEngine) {
+        log_queue_push(&g_logQueueEngine, seq, line, len);
+        return;
+    }
+    pthread_mutex_lock(&g_logQueueLock);
+    log_queue_push(&g_logQueue, seq, line, len);
+    pthread_mutex_unlock(&g_logQueueLock);
+}
+
+static unsigned long log_queue_dropped(void)
+{
+    return atomic_load_explicit(&g_logQueue.dropped, memory_order_relaxed)
+         + atomic_load_explicit(&g_logQueueEngine.dropped, memory_order_relaxed);
+}
+
+// Consumer side: append everything queued so far to `fp`, merging the
+// two rings by sequence number, and flush once
+static void log_queue_drain(FILE *fp)
+{
+    static uint8_t s_defWritten[LOG_MAX_FORMATS];
+
+    LogQueue *qs[2] = { &g_logQueue, &g_logQueueEngine };
+    size_t    head[2], tail[2];
+    for (int i = 0; i < 2; i++) {
+        head[i] = atomic_load_explicit(&qs[i]->head, memory_order_acquire);
+        tail[i] = atomic_load_explicit(&qs[i]->tail, memory_order_relaxed);
+    }
+    if (head[0] == tail[0] && head[1] == tail[1]) return;
+
+    char line[sizeof(uint16_t) + sizeof(int64_t) + LOG_LINE_MAX];  // longest record
+    for (;;) {
+        int      pick = -1;
+        uint64_t first = 0;
+        for (int i = 0; i < 2; i++) {
+            uint64_t seq;
+            if (tail[i] == head[i]) continue;
+            log_queue_copy_out(qs[i], tail[i] + sizeof(uint16_t), &seq, sizeof(seq));
+            if (pick < 0 || seq < first) {
+                pick  = i;
+                first = seq;
+            }
+        }
+        if (pick < 0) break;
+
+        LogQueue *q = qs[pick];
+        uint16_t  n;
+        log_queue_copy_out(q, tail[pick], &n, sizeof(n));
+        log_queue_copy_out(q, tail[pick] + sizeof(n) + sizeof(uint64_t), line, n);
+        tail[pick] += sizeof(n) + sizeof(uint64_t) + n;
+
+        if (!g_logBinary) {
+            fwrite(line, 1, n, fp);
+            fputc('\n', fp);
+            continue;
+        }
+
+        uint16_t id;
+        memcpy(&id, line, sizeof(id));
+        if (id != 0 && !s_defWritten[id]) {
+            const char *fmt = g_logFormats[id].fmt;
+            uint16_t    fl  = (uint16_t)strlen(fmt);
+            fputc('F', fp);
+            fwrite(&id, sizeof(id), 1, fp);
+            fwrite(&fl, sizeof(fl), 1, fp);
+            fwrite(fmt, 1, fl, fp);
+            s_defWritten[id] = 1;
+        }
+        fputc('R', fp);
+        fwrite(&n, sizeof(n), 1, fp);
+        fwrite(line, 1, n, fp);
+    }
+    for (int i = 0; i < 2; i++) {
+        atomic_store_explicit(&qs[i]->tail, tail[i], memory_order_release);
+    }
+    fflush(fp);
+}
+
+static void *log_writer_main(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&g_logThreadStop)) {
+        struct timespec ts = { g_logCommitMs / 1000, (g_logCommitMs % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+        log_queue_drain(g_fileLog);
+    }
+    log_queue_drain(g_fileLog);
+    return NULL;
+}
+
+static void log_writer_start(void)
+{
+    if (!g_fileLog) return;
+    if (g_logBinary) {
+        fseek(g_fileLog, 0, SEEK_END);
+        if (ftell(g_fileLog) == 0) {
+            fputs(LOG_BIN_MAGIC, g_fileLog);
+        }
+        fputc('S', g_fileLog);
+        fflush(g_fileLog);
+    }
+    if (pthread_create(&g_logThread, NULL, log_writer_main, NULL) != 0) {
+        fprintf(stderr, "WARNING: Could not start log writer, logsXtest.txt disabled.\n");
+        return;
+    }
+    g_logThreadRunning = 1;
+}
+
+// Flushes whatever is still queued; call before closing g_fileLog
+static void log_writer_stop(void)
+{
+    if (!g_logThreadRunning) return;
+    atomic_store(&g_logThreadStop, 1);
+    pthread_join(g_logThread, NULL);
+    g_logThreadRunning = 0;
+}
+
+// Claim the ring slot for the next line; *seq gets its sequence number.
+// NULL if a line 200 back is still being copied into the same slot (the
+// new line then only goes to the file; the screen shows that row blank).
+static LogSlot *log_slot_claim(uint64_t *seq)
+{
+    *seq = atomic_fetch_add_explicit(&g_logSeq, 1, memory_order_relaxed);
+    _Atomic uint64_t *ver = &g_logSlotVer[*seq % MAX_LOG_LINES];
+    uint64_t          old = atomic_load_explicit(ver, memory_order_relaxed);
+    if ((old & 1) || !atomic_compare_exchange_strong_explicit(ver, &old, 2 * *seq + 1,
+                                                              memory_order_acquire,
+                                                              memory_order_relaxed))
+    {
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_release);
+    return &g_logBuffer[*seq % MAX_LOG_LINES];
+}
+
+static void log_slot_publish(uint64_t seq)
+{
+    atomic_store_explicit(&g_logSlotVer[seq % MAX_LOG_LINES], 2 * seq + 2,
+                          memory_order_release);
+}
+
+// ---------------------------------------------------------------------
+// add_log
+//   Writes to our ring-buffer logs *and* queues the line for logsXtest.txt.
+//   Neither step takes a lock the UI thread holds while drawing.
+//   Lines below the g_logLevel threshold are dropped here; the LOG_*
+//   macros usually skip the call before it gets this far. add_log_always
+//   writes at its level whatever the threshold.
+// ---------------------------------------------------------------------
+static void log_vwrite(int level, const char *fmt, va_list args)
+{
+    if (level >= g_logEchoLevel) {
+        char    line[LOG_LINE_MAX];
+        va_list copy;
+        va_copy(copy, args);
+        vsnprintf(line, sizeof(line), fmt, copy);
+        va_end(copy);
+        fprintf(stderr, "%s\n", line);
+    }
+
+    // Binary mode: keep the raw arguments, format later (if ever)
+    int id = g_logBinary ? log_intern(fmt) : 0;
+    if (id > 0) {
+        char     rec[sizeof(uint16_t) + sizeof(int64_t) + sizeof(g_logBuffer[0].data)];
+        char    *data = rec + sizeof(uint16_t) + sizeof(int64_t);
+        uint16_t fid  = (uint16_t)id;
+        int64_t  ts   = wall_ns();
+        size_t   n    = log_encode_args(&g_logFormats[id], args, data, sizeof(g_logBuffer[0].data));
+        memcpy(rec, &fid, sizeof(fid));
+        memcpy(rec + sizeof(fid), &ts, sizeof(ts));
+
+        uint64_t seq;
+        LogSlot *slot = log_slot_claim(&seq);
+        if (slot) {
+            slot->fmtId = fid;
+            slot->len   = (uint16_t)n;
+            memcpy(slot->data, data, n);
+            log_slot_publish(seq);
+        }
+        log_file_push(seq, rec, sizeof(fid) + sizeof(ts) + n);
+        return;
+    }
+
+    // 1) Build the new log string in a temporary buffer
+    char tmp[LOG_LINE_MAX];
+    int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    if (len < 0) len = 0;
+    if (len >= (int)sizeof(tmp)) len = (int)sizeof(tmp) - 1;
+
+    // 2) Store in ring buffer
+    uint64_t seq;
+    LogSlot *slot = log_slot_claim(&seq);
+    if (slot) {
+        size_t keep = (size_t)len < sizeof(slot->data) - 1 ? (size_t)len : sizeof(slot->data) - 1;
+        memcpy(slot->data, tmp, keep);
+        slot->data[keep] = '\0';
+        slot->fmtId = 0;
+        slot->len   = (uint16_t)keep;
+        log_slot_publish(seq);
+    }
+
+    // 3) Also hand it to the logsXtest.txt writer (if running)
+    if (g_logThreadRunning) {
+        if (g_logBinary) {
+            // Text fallback record: ID 0, then the formatted line
+            char     rec[sizeof(uint16_t) + sizeof(int64_t) + sizeof(tmp)];
+            uint16_t fid = 0;
+            int64_t  ts  = wall_ns();
+            memcpy(rec, &fid, sizeof(fid));
+            memcpy(rec + sizeof(fid), &ts, sizeof(ts));
+            memcpy(rec + sizeof(fid) + sizeof(ts), tmp, (size_t)len);
+            log_file_push(seq, rec, sizeof(fid) + sizeof(ts) + (size_t)len);
+        } else {
+            log_file_push(seq, tmp, (size_t)len);
+        }
+    }
+}
+
+static void add_log(int level, const char *fmt, ...)
+{
+    if (!LOG_ENABLED(level)) return;
+
+    va_list args;
+    va_start(args, fmt);
+    log_vwrite(level, fmt, args);
+    va_end(args);
+}
+
+// Like add_log, but past the g_logLevel threshold: for the one line that
+// reports a change of that threshold
+static void add_log_always(int level, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    log_vwrite(level, fmt, args);
+    va_end(args);
+}
+
+// ---------------------------------------------------------------------
+// draw_logs:
+//   Newest line at the bottom of `win`. Only lines added since the last
+//   call are written: the window is scrolled up by that many rows and
+//   the new lines fill the bottom. `full` repaints every row.
+// ---------------------------------------------------------------------
+static void draw_logs(WINDOW *win, int full)
+{
+    static uint64_t shownSeq = 0;
+
+    int rows, cols;
+    getmaxyx(win, rows, cols);
+    if (rows <= 0) return;
+    if (rows > MAX_LOG_LINES) rows = MAX_LOG_LINES;
+
+    // Lines up to the first one still being written; the rest wait for
+    // the next frame. A version past 2*seq+2 means the slot was reused.
+    uint64_t seq  = atomic_load_explicit(&g_logSeq, memory_order_acquire);
+    uint64_t done = seq - shownSeq > (uint64_t)rows ? seq - (uint64_t)rows : shownSeq;
+    while (done < seq
+           && atomic_load_explicit(&g_logSlotVer[done % MAX_LOG_LINES], memory_order_acquire)
+              >= 2 * done + 2)
+    {
+        done++;
+    }
+
+    // Copy the new slots out first; the engine may be logging. A slot
+    // that changed under the copy is shown blank.
+    static LogSlot snap[MAX_LOG_LINES];
+    uint64_t fresh = done - shownSeq;
+    int      count = (full || fresh > (uint64_t)rows) ? rows : (int)fresh;
+    for (int i = 0; i < count; i++) {
+        uint64_t at   = done - 1 - (uint64_t)i;  // unused once i >= done
+        size_t   k    = at % MAX_LOG_LINES;
+        int      ok   = (uint64_t)i < done
+                     && atomic_load_explicit(&g_logSlotVer[k], memory_order_acquire) == 2 * at + 2;
+        if (ok) {
+            memcpy(&snap[i], &g_logBuffer[k], sizeof(snap[i]));
+            atomic_thread_fence(memory_order_acquire);
+            ok = atomic_load_explicit(&g_logSlotVer[k], memory_order_relaxed) == 2 * at + 2;
+        }
+        if (!ok) {
+            snap[i].fmtId   = 0;
+            snap[i].len     = 0;
+            snap[i].data[0] = '\0';
+        }
+    }
+    shownSeq = done;
+
+    if (count == 0) return;
+    if (count < rows) {
+        scrollok(win, TRUE);
+        wscrl(win, count);
+        scrollok(win, FALSE);
+    }
+
+    char line[256];
+    for (int i = 0; i < count; i++) {
+        wmove(win, rows - 1 - i, 0);
+        wclrtoeol(win);
+        waddnstr(win, log_slot_text(&snap[i], line, sizeof(line)), cols);
+    }
+}
+
+// ---------------------------------------------------------------------
+// Output backends
+//   Every key edge the engine sends goes through one of these:
+//   - xtest:  XTestFakeKeyEvent on the X connection (the default)
+//   - null:   drops the edges; what is left is parser and scheduler cost
+//   - record: keeps each edge and its time in memory
+//   - dryrun: like record, but on a virtual clock that jumps straight
+//             to every deadline, so a run takes no wall time at all
+//   --backend picks one at startup. Only the engine thread uses it.
+// ---------------------------------------------------------------------
+typedef struct {
+    const char *name;
+    void      (*key)(KeyCode kc, KeySym ks, int down);  // queue one edge
+    void      (*flush)(void);                // send everything queued
+    void      (*sync)(void);                 // ...and wait until it has been handled
+    int64_t   (*now)(void);                  // clock the edges are timed by (ns)
+    void      (*advance)(int64_t deadline);  // virtual clocks only: jump to deadline
+    void      (*bind)(KeyCode kc, KeySym ks);  // scratch keycode rebound; NULL => on the server
+} KeyBackend;
+
+static int64_t mono_ns(void);
+
+static Display *g_xtestDpy = NULL;  // set before the engine thread starts
+
+static void xtest_key(KeyCode kc, KeySym ks, int down)
+{
+    (void)ks;
+    XTestFakeKeyEvent(g_xtestDpy, kc, down, CurrentTime);
+}
+
+static void xtest_flush(void)               { XFlush(g_xtestDpy); }
+static void xtest_sync(void)                { XSync(g_xtestDpy, False); }
+
+static void null_key(KeyCode kc, KeySym ks, int down) { (void)kc; (void)ks; (void)down; }
+static void null_flush(void)                           { }
+static void null_bind(KeyCode kc, KeySym ks)           { (void)kc; (void)ks; }
+
+enum {
+    REC_UP,
+    REC_DOWN,
+    REC_BIND  // scratch keycode `code` now types `sym` (NoSymbol: emptied)
+};
+
+typedef struct {
+    int64_t  atNs;  // backend clock when the edge was queued
+    uint32_t sym;   // KeySym the plan meant (NoSymbol for abort releases)
+    uint16_t code;
+    uint8_t  kind;     // REC_*
+    uint8_t  flushed;  // 1 once a flush has sent it
+} RecordedEdge;
+
+static RecordedEdge *g_recEdges   = NULL;
+static size_t        g_recCount   = 0;
+static size_t        g_recCap     = 0;
+static size_t        g_recFlushed = 0;  // edges covered by a flush so far
+static int64_t       g_recStartNs = 0;  // backend clock when the run began
+
+static const KeyBackend *g_backend;
+
+static void record_push(KeyCode kc, KeySym ks, int kind)
+{
+    if (g_recCount == g_recCap) {
+        size_t        newCap = g_recCap ? g_recCap * 2 : 4096;
+        RecordedEdge *grown  = realloc(g_recEdges, newCap * sizeof(*grown));
+        if (!grown) return;  // the edge is lost, the run goes on
+        g_recEdges = grown;
+        g_recCap   = newCap;
+    }
+    g_recEdges[g_recCount++] = (RecordedEdge){ g_backend->now(), (uint32_t)ks, kc, (uint8_t)kind, 0 };
+}
+
+static void record_key(KeyCode kc, KeySym ks, int down) { record_push(kc, ks, down ? REC_DOWN : REC_UP); }
+static void record_bind(KeyCode kc, KeySym ks)          { record_push(kc, ks, REC_BIND); }
+
+static void record_flush(void)
+{
+    for (; g_recFlushed < g_recCount; g_recFlushed++) {
+        g_recEdges[g_recFlushed].flushed = 1;
+    }
+}
+
+static void record_clear(void)
+{
+    g_recCount   = 0;
+    g_recFlushed = 0;
+    g_recStartNs = g_backend->now();
+}
+
+// Virtual time only moves when the engine would otherwise sleep
+static int64_t g_virtualNs = 0;
+
+static int64_t virtual_ns(void)              { return g_virtualNs; }
+static void    virtual_advance(int64_t when) { if (when > g_virtualNs) g_virtualNs = when; }
+
+static const KeyBackend g_backends[] = {
+    { "xtest",  xtest_key,  xtest_flush,  xtest_sync,   mono_ns,    NULL,            NULL },
+    { "null",   null_key,   null_flush,   null_flush,   mono_ns,    NULL,            null_bind },
+    { "record", record_key, record_flush, record_flush, mono_ns,    NULL,            record_bind },
+    { "dryrun", record_key, record_flush, record_flush, virtual_ns, virtual_advance, record_bind },
+};
+static const KeyBackend *g_backend = &g_backends[0];
+
+static int backend_select(const char *name)
+{
+    for (size_t b = 0; b < sizeof(g_backends) / sizeof(g_backends[0]); b++) {
+        if (strcmp(name, g_backends[b].name) == 0) {
+            g_backend = &g_backends[b];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int backend_is_xtest(void)
+{
+    return g_backend == &g_backends[0];
+}
+
+// ---------------------------------------------------------------------
+// Press/Release Keys
+//   Edges only land in the backend's queue (Xlib's output buffer for
+//   XTest); flushKeys() sends the whole group with a single flush.
+//   Keycodes come from the keymap cache below, so no per-edge lookups.
+// ---------------------------------------------------------------------
+static int           g_batchWindowMs = 0; // waits shorter than this stay in one group
+static int           g_batchPending  = 0; // edges queued since the last flush
+static atomic_ulong  g_flushCount    = 0; // read by the UI thread
+static atomic_ulong  g_edgeCount     = 0;
+
+static void pressKeyDown(KeyCode kc, KeySym ks)
+{
+    g_backend->key(kc, ks, 1);
+    g_batchPending++;
+    g_edgeCount++;
+}
+
+static void pressKeyUp(KeyCode kc, KeySym ks)
+{
+    g_backend->key(kc, ks, 0);
+    g_batchPending++;
+    g_edgeCount++;
+}
+
+// Group boundary: send everything queued so far
+static void flushKeys(void)
+{
+    if (!g_batchPending) return;
+    g_backend->flush();
+    g_batchPending = 0;
+    g_flushCount++;
+}
+
+// ---------------------------------------------------------------------
+// map_char_to_keysym: single normal character -> KeySym
+// ---------------------------------------------------------------------
+static KeySym map_char_to_keysym(char c)
+{
+    switch(c)
+    {
+        case ' ':  return XK_space;
+        case '!':  return XK_exclam;
+        case '"':  return XK_quotedbl;
+        case '#':  return XK_numbersign;
+        case '$':  return XK_dollar;
+        case '%':  return XK_percent;
+        case '&':  return XK_ampersand;
+        case '\'': return XK_apostrophe;
+        case '(':  return XK_parenleft;
+        case ')':  return XK_parenright;
+        case '*':  return XK_asterisk;
+        case '+':  return XK_plus;
+        case ',':  return XK_comma;
+        case '-':  return XK_minus;
+        case '.':  return XK_period;
+        case '/':  return XK_slash;
+        case ':':  return XK_colon;
+        case ';':  return XK_semicolon;
+        case '<':  return XK_less;
+        case '=':  return XK_equal;
+        case '>':  return XK_greater;
+        case '?':  return XK_question;
+        case '@':  return XK_at;
+        case '[':  return XK_bracketleft;
+        case '\\': return XK_backslash;
+        case ']':  return XK_bracketright;
+        case '^':  return XK_asciicircum;
+        case '_':  return XK_underscore;
+        case '`':  return XK_grave;
+        case '{':  return XK_braceleft;
+        case '|':  return XK_bar;
+        case '}':  return XK_braceright;
+        case '~':  return XK_asciitilde;
+
+        // newline -> Return
+        case '\n':
+        case '\r':
+            return XK_Return;
+    }
+
+    // Letters, digits, etc.
+    char buf[2] = { c, 0 };
+    KeySym ks = XStringToKeysym(buf);
+    if (ks == NoSymbol) {
+        return NoSymbol;
+    }
+    return ks;
+}
+
+// ---------------------------------------------------------------------
+// utf8_keysym: decodes the character at `text` (up to len bytes) and
+//   returns how many bytes it used. *ks is its KeySym: Latin-1 keeps
+//   its own value, everything else the 0x01000000 + codepoint range.
+//   A malformed sequence uses one byte and yields NoSymbol.
+// ---------------------------------------------------------------------
+static int utf8_keysym(const char *text, size_t len, KeySym *ks)
+{
+    unsigned char c = (unsigned char)text[0];
+    if (c < 0x80) {
+        *ks = map_char_to_keysym((char)c);
+        return 1;
+    }
+
+    int      extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    uint32_t cp    = c & (0x3f >> extra);
+    *ks = NoSymbol;
+    if (extra == 0 || c > 0xf4 || (size_t)extra >= len) return 1;
+    for (int k = 1; k <= extra; k++) {
+        unsigned char cc = (unsigned char)text[k];
+        if ((cc & 0xc0) != 0x80) return 1;
+        cp = (cp << 6) | (cc & 0x3f);
+    }
+    static const uint32_t minCp[4] = { 0, 0x80, 0x800, 0x10000 };
+    if (cp < minCp[extra] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) return 1;
+
+    *ks = cp < 0x100 ? (KeySym)cp : (KeySym)(0x01000000 | cp);
+    return extra + 1;
+}
+
+// Name of `ks` for listings. XKeysymToString mallocs (and never frees)
+// the name of every Unicode KeySym, so those are formatted into `buf`.
+static const char *keysym_name(KeySym ks, char *buf, size_t size)
+{
+    if (ks >= 0x01000100 && ks <= 0x0110ffff) {
+        snprintf(buf, size, "U%04lX", (unsigned long)(ks & 0xffffff));
+        return buf;
+    }
+    return XKeysymToString(ks);
+}
+
+// ---------------------------------------------------------------------
+// Keymap cache: KeySym -> (keycode, modifiers) from the live keymap.
+//   - g_charKeys: 256 entries indexed by the typed byte
+//   - g_symKeys:  open-addressing hash for every other reachable KeySym
+// Both are rebuilt when the server sends MappingNotify.
+// ---------------------------------------------------------------------
+typedef struct {
+    KeySym   sym;   // NoSymbol => empty slot / unreachable
+    uint16_t code;  // keycode to press
+    uint16_t mods;  // modifier mask that must be held (ShiftMask, level 3)
+} KeyEntry;
+
+#define KEYMAP_HASH_SIZE 4096  // power of two, well above keycodes * levels
+
+static KeyEntry g_charKeys[256];
+static KeyEntry g_symKeys[KEYMAP_HASH_SIZE];
+static KeyCode  g_modKeycode[8];     // key to press for each modifier bit
+static KeySym   g_modKeysym[8];      // ...and its KeySym, for logs and dumps
+static unsigned g_level3Mask = 0;    // modifier bit carrying ISO_Level3_Shift
+static unsigned g_keymapGen  = 0;    // bumped on every rebuild
+static int      g_keymapDirty = 1;
+
+// Scratch keycodes: spare keycodes (no KeySyms when first seen) that
+// characters missing from the layout get bound to while they are typed.
+// They are left out of the tables above; see "Scratch keycodes" below.
+#define SCRATCH_MAX     16
+#define SCRATCH_UNKNOWN ((KeySym)-1)  // binding overwritten by someone else
+static KeyCode  g_scratchCode[SCRATCH_MAX];   // ascending
+static KeySym   g_scratchBound[SCRATCH_MAX];  // what the server has now
+static KeySym   g_scratchModel[SCRATCH_MAX];  // ...as far as a non-XTest backend knows
+static int      g_scratchCount  = 0;
+static int      g_scratchProbed = 0;
+
+static int scratch_slot(KeyCode kc)
+{
+    for (int s = 0; s < g_scratchCount; s++) {
+        if (g_scratchCode[s] == kc) return s;
+    }
+    return -1;
+}
+
+static unsigned keymap_hash(KeySym ks)
+{
+    return (unsigned)(((uint64_t)ks * 0x9E3779B97F4A7C15ull) >> 52) & (KEYMAP_HASH_SIZE - 1);
+}
+
+static const KeyEntry *keymap_lookup(KeySym ks)
+{
+    if (ks == NoSymbol) return NULL;
+    for (unsigned h = keymap_hash(ks), n = 0; n < KEYMAP_HASH_SIZE; n++) {
+        const KeyEntry *e = &g_symKeys[(h + n) & (KEYMAP_HASH_SIZE - 1)];
+        if (e->sym == ks)       return e;
+        if (e->sym == NoSymbol) return NULL;
+    }
+    return NULL;
+}
+
+static const KeyEntry *keymap_lookup_char(unsigned char c)
+{
+    return g_charKeys[c].code ? &g_charKeys[c] : NULL;
+}
+
+// Keep the cheapest way to reach `ks`: fewest modifiers, then lowest keycode
+static void keymap_insert(KeySym ks, KeyCode kc, unsigned mods)
+{
+    if (ks == NoSymbol) return;
+    if (mods & ~(ShiftMask | g_level3Mask)) return;  // never press Lock/NumLock/...
+
+    for (unsigned h = keymap_hash(ks), n = 0; n < KEYMAP_HASH_SIZE; n++) {
+        KeyEntry *e = &g_symKeys[(h + n) & (KEYMAP_HASH_SIZE - 1)];
+        if (e->sym == NoSymbol) {
+            e->sym  = ks;
+            e->code = kc;
+            e->mods = (uint16_t)mods;
+            return;
+        }
+        if (e->sym == ks) {
+            if (__builtin_popcount(mods) < __builtin_popcount(e->mods)) {
+                e->code = kc;
+                e->mods = (uint16_t)mods;
+            }
+            return;
+        }
+    }
+}
+
+// Modifier mask that selects shift level `level` of key `kc` in group 1
+static int xkb_level_mods(XkbDescPtr xkb, KeyCode kc, int level)
+{
+    if (level == 0) return 0;
+    XkbKeyTypePtr type = XkbKeyKeyType(xkb, kc, 0);
+    for (int i = 0; i < type->map_count; i++) {
+        if (type->map[i].active && type->map[i].level == level) {
+            return type->map[i].mods.mask;
+        }
+    }
+    return -1;
+}
+
+static void keymap_build(Display *dpy)
+{
+    int minKc, maxKc;
+    XDisplayKeycodes(dpy, &minKc, &maxKc);
+
+    memset(g_symKeys, 0, sizeof(g_symKeys));
+    memset(g_charKeys, 0, sizeof(g_charKeys));
+    memset(g_modKeycode, 0, sizeof(g_modKeycode));
+    memset(g_modKeysym, 0, sizeof(g_modKeysym));
+    g_level3Mask = 0;
+
+    // Which key to hold for each modifier bit, and which bit is level 3
+    XModifierKeymap *modmap = XGetModifierMapping(dpy);
+    if (modmap) {
+        for (int bit = 0; bit < 8; bit++) {
+            for (int k = 0; k < modmap->max_keypermod; k++) {
+                KeyCode kc = modmap->modifiermap[bit * modmap->max_keypermod + k];
+                if (!kc) continue;
+                KeySym ks = XkbKeycodeToKeysym(dpy, kc, 0, 0);
+                if (!g_modKeycode[bit]) {
+                    g_modKeycode[bit] = kc;
+                    g_modKeysym[bit]  = ks;
+                }
+                if (ks == XK_ISO_Level3_Shift) {
+                    g_level3Mask = 1u << bit;
+                    g_modKeycode[bit] = kc;
+                    g_modKeysym[bit]  = ks;
+                }
+            }
+        }
+        XFreeModifiermap(modmap);
+    }
+
+    // The pool is picked once, from the top of the range down, before
+    // we have bound anything; later rebuilds leave it alone. Only XTest
+    // output rebinds it on the server; the other backends model it.
+    int probe = !g_scratchProbed;
+    g_scratchProbed = 1;
+
+    int levelsSeen = 0;
+    const char *source = "XKB";
+    XkbDescPtr xkb = XkbGetMap(dpy, XkbKeyTypesMask | XkbKeySymsMask, XkbUseCoreKbd);
+    if (xkb) {
+        for (int kc = maxKc; probe && kc >= minKc && g_scratchCount < SCRATCH_MAX; kc--) {
+            if (XkbKeyNumGroups(xkb, kc) == 0) g_scratchCode[g_scratchCount++] = (KeyCode)kc;
+        }
+        for (int kc = minKc; kc <= maxKc; kc++) {
+            if (XkbKeyNumGroups(xkb, kc) == 0 || scratch_slot((KeyCode)kc) >= 0) continue;
+            int width = XkbKeyGroupWidth(xkb, kc, 0);
+            for (int level = 0; level < width; level++) {
+                int mods = xkb_level_mods(xkb, (KeyCode)kc, level);
+                if (mods < 0) continue;
+                keymap_insert(XkbKeySymEntry(xkb, kc, level, 0), (KeyCode)kc, (unsigned)mods);
+                levelsSeen++;
+            }
+        }
+        XkbFreeKeyboard(xkb, 0, True);
+    } else {
+        // No XKB: core mapping, column 0 plain and column 1 shifted
+        source = "core";
+        int per = 0;
+        KeySym *syms = XGetKeyboardMapping(dpy, (KeyCode)minKc, maxKc - minKc + 1, &per);
+        if (syms) {
+            for (int kc = maxKc; probe && kc >= minKc && g_scratchCount < SCRATCH_MAX; kc--) {
+                int col = 0;
+                while (col < per && syms[(kc - minKc) * per + col] == NoSymbol) col++;
+                if (col == per) g_scratchCode[g_scratchCount++] = (KeyCode)kc;
+            }
+            for (int kc = minKc; kc <= maxKc; kc++) {
+                if (scratch_slot((KeyCode)kc) >= 0) continue;
+                for (int col = 0; col < per && col < 2; col++) {
+                    keymap_insert(syms[(kc - minKc) * per + col], (KeyCode)kc,
+                                  col ? ShiftMask : 0);
+                    levelsSeen++;
+                }
+            }
+            XFree(syms);
+        }
+    }
+
+    // Flatten the typed-byte table
+    for (int c = 1; c < 256; c++) {
+        const KeyEntry *e = keymap_lookup(map_char_to_keysym((char)c));
+        if (e) g_charKeys[c] = *e;
+    }
+
+    if (probe) {
+        // Ascending, so runs of neighbours can be rebound in one request
+        for (int a = 1; a < g_scratchCount; a++) {
+            for (int b = a; b > 0 && g_scratchCode[b - 1] > g_scratchCode[b]; b--) {
+                KeyCode t = g_scratchCode[b];
+                g_scratchCode[b]     = g_scratchCode[b - 1];
+                g_scratchCode[b - 1] = t;
+            }
+        }
+        for (int i = 0; i < g_scratchCount; i++) g_scratchBound[i] = NoSymbol;
+        LOG_INFO("%d spare keycode(s) for characters missing from the layout",
+                 g_scratchCount);
+    }
+
+    g_keymapGen++;
+    g_keymapDirty = 0;
+    LOG_INFO("Keymap built (%s, %d key levels, gen %u)",
+             source, levelsSeen, g_keymapGen);
+}
+
+// ---------------------------------------------------------------------
+// keymap_build_builtin: a US QWERTY layout with evdev keycodes, for the
+//   null and record backends when there is no X display to ask.
+// ---------------------------------------------------------------------
+static void keymap_build_builtin(void)
+{
+    static const struct {
+        KeyCode     first;
+        const char *plain;
+        const char *shifted;
+    } rows[] = {
+        { 10, "1234567890-=",  "!@#$%^&*()_+" },
+        { 24, "qwertyuiop[]",  "QWERTYUIOP{}" },
+        { 38, "asdfghjkl;'`",  "ASDFGHJKL:\"~" },
+        { 51, "\\",            "|"            },
+        { 52, "zxcvbnm,./",    "ZXCVBNM<>?"   },
+    };
+    static const struct {
+        KeyCode code;
+        KeySym  sym;
+    } keys[] = {
+        {  9, XK_Escape },    { 22, XK_BackSpace }, { 23, XK_Tab },
+        { 36, XK_Return },    { 37, XK_Control_L }, { 50, XK_Shift_L },
+        { 64, XK_Alt_L },     { 65, XK_space },     { 110, XK_Home },
+        { 111, XK_Up },       { 112, XK_Page_Up },  { 113, XK_Left },
+        { 114, XK_Right },    { 115, XK_End },      { 116, XK_Down },
+        { 117, XK_Page_Down }, { 118, XK_Insert },  { 119, XK_Delete },
+        { 95, XK_F11 },       { 96, XK_F12 },
+    };
+
+    memset(g_symKeys, 0, sizeof(g_symKeys));
+    memset(g_charKeys, 0, sizeof(g_charKeys));
+    memset(g_modKeycode, 0, sizeof(g_modKeycode));
+    memset(g_modKeysym, 0, sizeof(g_modKeysym));
+    g_level3Mask      = 0;
+    g_modKeycode[0]   = 50;  // ShiftMask
+    g_modKeysym[0]    = XK_Shift_L;
+    g_scratchProbed   = 1;
+
+    // Spare keycodes for the model: evdev leaves the top of the range unused
+    g_scratchCount = SCRATCH_MAX;
+    for (int s = 0; s < SCRATCH_MAX; s++) {
+        g_scratchCode[s]  = (KeyCode)(256 - SCRATCH_MAX + s);
+        g_scratchBound[s] = NoSymbol;
+    }
+
+    for (size_t r = 0; r < sizeof(rows) / sizeof(rows[0]); r++) {
+        for (int c = 0; rows[r].plain[c]; c++) {
+            KeyCode kc = (KeyCode)(rows[r].first + c);
+            keymap_insert(map_char_to_keysym(rows[r].plain[c]),   kc, 0);
+            keymap_insert(map_char_to_keysym(rows[r].shifted[c]), kc, ShiftMask);
+        }
+    }
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        keymap_insert(keys[k].sym, keys[k].code, 0);
+    }
+    for (int n = 0; n < 10; n++) {
+        keymap_insert(XK_F1 + n, (KeyCode)(67 + n), 0);
+    }
+    for (int c = 1; c < 256; c++) {
+        const KeyEntry *e = keymap_lookup(map_char_to_keysym((char)c));
+        if (e) g_charKeys[c] = *e;
+    }
+
+    g_keymapGen++;
+    g_keymapDirty = 0;
+    LOG_INFO("No X display: using the built-in US keymap (gen %u)", g_keymapGen);
+}
+
+// MappingNotify for keycodes that are all in the scratch pool, i.e. our own
+static int scratch_owns(int first, int count)
+{
+    if (g_scratchCount == 0 || count <= 0) return 0;
+    for (int kc = first; kc < first + count; kc++) {
+        if (scratch_slot((KeyCode)kc) < 0) return 0;
+    }
+    return 1;
+}
+
+// Drain pending X events; rebuild the keymap if a MappingNotify came in
+static void keymap_sync(Display *dpy)
+{
+    if (!dpy) return;  // built-in keymap, nothing to follow
+    while (XPending(dpy)) {
+        XEvent ev;
+        XNextEvent(dpy, &ev);
+        if (ev.type == MappingNotify) {
+            XRefreshKeyboardMapping(&ev.xmapping);
+            if (ev.xmapping.request == MappingKeyboard
+                && scratch_owns(ev.xmapping.first_keycode, ev.xmapping.count))
+            {
+                continue;  // our own scratch binding
+            }
+            if (ev.xmapping.request != MappingPointer) {
+                g_keymapDirty = 1;
+                // Someone else may have rewritten the scratch keys too
+                for (int s = 0; s < g_scratchCount; s++) {
+                    if (g_scratchBound[s] != NoSymbol) g_scratchBound[s] = SCRATCH_UNKNOWN;
+                }
+            }
+        }
+    }
+    if (g_keymapDirty) {
+        keymap_build(dpy);
+    }
+}
+
+// ---------------------------------------------------------------------
+// Loading messages.txt so {messageN} can expand
+//   At startup the file is mapped and indexed lazily, so startup is O(1)
+//   in its size. The UI thread watches it with inotify, reads a fresh
+//   private copy on change (so an in-place rewrite cannot alter it) and
+//   publishes it with one atomic pointer swap. The engine pins the
+//   snapshot it runs with through a hazard pointer, so a run never sees a
+//   half-loaded table and never waits on the reload; a retired snapshot
+//   is freed once it is no longer pinned. A file truncated under the
+//   mapping is caught by a size recheck before the mapping is touched.
+// ---------------------------------------------------------------------
+static _Atomic(MessageStore *) g_msgCurrent = NULL;  // newest snapshot
+static _Atomic(MessageStore *) g_msgHazard  = NULL;  // pinned by the engine
+
+#define MSG_RETIRED_MAX 4
+static MessageStore *g_msgRetired[MSG_RETIRED_MAX];  // UI thread only
+static int           g_msgRetiredCount = 0;
+
+static const char *g_msgPath     = "messages.txt";
+static int         g_msgWatchFd  = -1;   // inotify, in the UI epoll set
+
+static void message_ops_free(MessageStore *ms);
+
+static void message_store_free(MessageStore *ms)
+{
+    if (!ms) return;
+    if (ms->mapSize) {
+        munmap((void *)ms->base, ms->mapSize);
+    } else {
+        free((void *)ms->base);
+    }
+    if (ms->fd >= 0) close(ms->fd);
+    message_ops_free(ms);
+    free(ms->lineStart);
+    free(ms);
+}
+
+// Engine side: before touching a mapping, drop whatever the file no
+// longer covers; pages past EOF would raise SIGBUS. The reload that the
+// truncation triggers replaces the snapshot for the next run.
+static void message_map_recheck(MessageStore *ms)
+{
+    struct stat st;
+    if (ms->fd < 0 || fstat(ms->fd, &st) != 0 || (size_t)st.st_size >= ms->size) return;
+
+    LOG_WARN("messages.txt shrank to %lld bytes mid-run; lines past it are gone",
+             (long long)st.st_size);
+    ms->size = (size_t)st.st_size;
+    while (ms->lineCount > 0 && ms->lineStart[ms->lineCount - 1] >= ms->size) {
+        ms->lineCount--;
+    }
+    if (ms->scanPos > ms->size) {
+        ms->scanPos = ms->size;
+    }
+}
+
+// Extend the line index until it covers line `n` (1-based) or the file ends
+static void message_index_to(MessageStore *ms, size_t n)
+{
+    message_map_recheck(ms);
+    while (ms->lineCount < n && ms->scanPos < ms->size) {
+        if (ms->lineCount == ms->lineCap) {
+            size_t  newCap = ms->lineCap ? ms->lineCap * 2 : 1024;
+            size_t *grown  = realloc(ms->lineStart, newCap * sizeof(size_t));
+            if (!grown) {
+                LOG_WARN("Out of memory indexing messages.txt (%zu lines)", ms->lineCount);
+                return;
+            }
+            ms->lineStart = grown;
+            ms->lineCap   = newCap;
+        }
+        ms->lineStart[ms->lineCount++] = ms->scanPos;
+
+        const char *nl = memchr(ms->base + ms->scanPos, '\n', ms->size - ms->scanPos);
+        ms->scanPos = nl ? (size_t)(nl - ms->base) + 1 : ms->size;
+    }
+}
+
+// Map `filename` into a new snapshot whose line index grows lazily with
+// use, so startup stays O(1) in the file size. The fd stays open for
+// message_map_recheck(). NULL if unreadable.
+static MessageStore *message_store_map(const char *filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    MessageStore *ms = calloc(1, sizeof(*ms));
+    struct stat   st;
+    if (!ms || fstat(fd, &st) != 0) {
+        free(ms);
+        close(fd);
+        return NULL;
+    }
+    ms->fd = fd;
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            free(ms);
+            close(fd);
+            return NULL;
+        }
+        ms->base    = map;
+        ms->size    = (size_t)st.st_size;
+        ms->mapSize = (size_t)st.st_size;
+    }
+    return ms;
+}
+
+// Read `filename` into a new, fully indexed snapshot (reloads, off the
+// engine's path). A private copy, unlike the mapping, cannot change or
+// shrink under a run when the file is rewritten in place. NULL if
+// unreadable.
+static MessageStore *message_store_copy(const char *filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    MessageStore *ms = calloc(1, sizeof(*ms));
+    struct stat   st;
+    char         *buf  = NULL;
+    size_t        size = 0;
+    size_t        cap  = ms && fstat(fd, &st) == 0 && st.st_size > 0 ? (size_t)st.st_size : 0;
+    // One byte of slack so an unchanged file ends in a short read, not a grow
+    for (cap++; ms; ) {
+        if (size == cap) cap *= 2;
+        char *grown = realloc(buf, cap);
+        if (!grown) break;
+        buf = grown;
+        ssize_t n = read(fd, buf + size, cap - size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) ms->base = buf;
+            break;
+        }
+        size += (size_t)n;
+    }
+    close(fd);
+    if (ms && !ms->base) {
+        free(buf);
+        free(ms);
+        ms = NULL;
+    } else if (ms) {
+        ms->size = size;
+        ms->fd   = -1;
+        message_index_to(ms, SIZE_MAX);
+    }
+    return ms;
+}
+
+static void load_messages_file(const char *filename)
+{
+    g_msgPath = filename;
+    MessageStore *ms = message_store_map(filename);
+    if (!ms) {
+        LOG_INFO("Could not open %s, so {messageN} won't work until it appears", filename);
+        return;
+    }
+    atomic_store(&g_msgCurrent, ms);
+    LOG_INFO("Mapped %s (%zu bytes) for {messageN}; lines are indexed on first use",
+             filename, ms->size);
+}
+
+// Engine side: pin the current snapshot for the length of a run
+static MessageStore *message_acquire(void)
+{
+    MessageStore *ms;
+    do {
+        ms = atomic_load(&g_msgCurrent);
+        atomic_store(&g_msgHazard, ms);
+    } while (ms != atomic_load(&g_msgCurrent));
+    return ms;
+}
+
+static void message_release(void)
+{
+    atomic_store(&g_msgHazard, NULL);
+}
+
+// UI side: free retired snapshots the engine no longer has pinned
+static void message_reclaim(void)
+{
+    MessageStore *pinned = atomic_load(&g_msgHazard);
+    int kept = 0;
+    for (int i = 0; i < g_msgRetiredCount; i++) {
+        if (g_msgRetired[i] == pinned) {
+            g_msgRetired[kept++] = g_msgRetired[i];
+        } else {
+            message_store_free(g_msgRetired[i]);
+        }
+    }
+    g_msgRetiredCount = kept;
+}
+
+// UI side: build a new snapshot of the file and swap it in
+static void message_reload(void)
+{
+    MessageStore *fresh = message_store_copy(g_msgPath);
+    if (!fresh) {
+        LOG_WARN("%s is gone; {messageN} keeps using the last version", g_msgPath);
+        return;
+    }
+
+    // With a single reader at most one retired snapshot stays pinned
+    message_reclaim();
+    MessageStore *old = atomic_exchange(&g_msgCurrent, fresh);
+    if (old) {
+        g_msgRetired[g_msgRetiredCount++] = old;
+        message_reclaim();
+    }
+    LOG_INFO("Reloaded %s (%zu lines)", g_msgPath, fresh->lineCount);
+}
+
+// UI side: watch the directory, since editors often save by rename.
+// Returns the inotify fd for the UI epoll set, or -1.
+static int message_watch_open(void)
+{
+    char dir[4096];
+    const char *slash = strrchr(g_msgPath, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - g_msgPath), g_msgPath);
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+
+    g_msgWatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_msgWatchFd < 0
+        || inotify_add_watch(g_msgWatchFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+        LOG_WARN("Could not watch %s for changes (no hot reload)", g_msgPath);
+        if (g_msgWatchFd >= 0) close(g_msgWatchFd);
+        g_msgWatchFd = -1;
+    }
+    return g_msgWatchFd;
+}
+
+// UI side: drain inotify; reload once if any event names our file
+static void message_watch_events(void)
+{
+    const char *base = strrchr(g_msgPath, '/');
+    base = base ? base + 1 : g_msgPath;
+
+    char    buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int     changed = 0;
+    ssize_t n;
+    while ((n = read(g_msgWatchFd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, base) == 0) changed = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+    if (changed) {
+        message_reload();
+    }
+}
+
+static void message_store_close(void)
+{
+    if (g_msgWatchFd >= 0) close(g_msgWatchFd);
+    g_msgWatchFd = -1;
+    message_store_free(atomic_exchange(&g_msgCurrent, NULL));
+    for (int i = 0; i < g_msgRetiredCount; i++) {
+        message_store_free(g_msgRetired[i]);
+    }
+    g_msgRetiredCount = 0;
+}
+
+// Line `n` (1-based) of a snapshot, straight from its bytes and
+// without its line ending. Returns -1 if the file has fewer lines.
+static int message_line(MessageStore *ms, size_t n, const char **text, size_t *len)
+{
+    if (!ms || n < 1) return -1;
+    message_index_to(ms, n);
+    if (n > ms->lineCount) return -1;
+
+    size_t      start = ms->lineStart[n - 1];
+    const char *line  = ms->base + start;
+    const char *nl    = memchr(line, '\n', ms->size - start);
+    size_t      l     = nl ? (size_t)(nl - line) : ms->size - start;
+    if (l > 0 && line[l - 1] == '\r') l--;
+
+    *text = line;
+    *len  = l;
+    return 0;
+}
+
+// Total line count; indexes the whole file, so only for error messages
+static size_t message_count(MessageStore *ms)
+{
+    if (!ms) return 0;
+    message_index_to(ms, SIZE_MAX);
+    return ms->lineCount;
+}
+
+// ---------------------------------------------------------------------
+// TokenAction: either a single KeySym press/hold or an "expanded text"
+// ---------------------------------------------------------------------
+typedef struct {
+    KeySym sym;           // 0 if not relevant
+    int holdMs;           // 0 if quick press
+    size_t msgLine;       // {messageN}: the line to splice in, 0 otherwise
+    const char *msgText;  // ...and a view of it in the snapshot (not NUL-terminated)
+    size_t msgLen;
+} TokenAction;
+
+// Parse the decimal digits at text[*idx] (up to len) into *value.
+// Returns the number of digits read.
+static int parse_digits(const char *text, size_t len, size_t *idx, long *value)
+{
+    int digits = 0;
+    *value = 0;
+    while (*idx < len && text[*idx] >= '0' && text[*idx] <= '9') {
+        if (*value < 100000000L) {
+            *value = *value * 10 + (text[*idx] - '0');
+        }
+        (*idx)++;
+        digits++;
+    }
+    return digits;
+}
+
+// ---------------------------------------------------------------------
+// Key names for {name} tokens
+//   The friendly names below, plus F1-F24 and kp0-kp9, go into a hash
+//   built on first use (case-insensitive), so a lookup is one hash and a
+//   probe however long the list grows. {keysym:Name} accepts any name
+//   from keysymdef.h through XStringToKeysym; its answers, misses
+//   included, are cached in a second hash. Engine thread only.
+// ---------------------------------------------------------------------
+#define KEYNAME_MAX       48   // longest name we look up, NUL included
+#define KEYNAME_HASH_SIZE 512  // power of two, per table
+
+typedef struct {
+    char   name[KEYNAME_MAX];  // "" => empty slot
+    KeySym sym;                // NoSymbol => cached miss
+} KeyName;
+
+static const struct {
+    const char *name;
+    KeySym      sym;
+} g_keyAliases[] = {
+    {"up",        XK_Up},        {"down",       XK_Down},
+    {"left",      XK_Left},      {"right",      XK_Right},
+    {"enter",     XK_Return},    {"return",     XK_Return},
+    {"shift",     XK_Shift_L},   {"rshift",     XK_Shift_R},
+    {"ctrl",      XK_Control_L}, {"rctrl",      XK_Control_R},
+    {"alt",       XK_Alt_L},     {"altgr",      XK_ISO_Level3_Shift},
+    {"super",     XK_Super_L},   {"win",        XK_Super_L},
+    {"menu",      XK_Menu},      {"space",      XK_space},
+    {"tab",       XK_Tab},       {"esc",        XK_Escape},
+    {"escape",    XK_Escape},    {"backspace",  XK_BackSpace},
+    {"bs",        XK_BackSpace}, {"delete",     XK_Delete},
+    {"del",       XK_Delete},    {"insert",     XK_Insert},
+    {"ins",       XK_Insert},    {"home",       XK_Home},
+    {"end",       XK_End},       {"pageup",     XK_Page_Up},
+    {"pgup",      XK_Page_Up},   {"pagedown",   XK_Page_Down},
+    {"pgdn",      XK_Page_Down}, {"capslock",   XK_Caps_Lock},
+    {"numlock",   XK_Num_Lock},  {"scrolllock", XK_Scroll_Lock},
+    {"print",     XK_Print},     {"pause",      XK_Pause},
+    {"kpenter",   XK_KP_Enter},  {"kpadd",      XK_KP_Add},
+    {"kpsubtract", XK_KP_Subtract}, {"kpmultiply", XK_KP_Multiply},
+    {"kpdivide",  XK_KP_Divide}, {"kpdecimal",  XK_KP_Decimal},
+    {NULL,        0}
+};
+
+static KeyName g_keyNames[KEYNAME_HASH_SIZE];    // aliases, folded to lower case
+static KeyName g_keysymCache[KEYNAME_HASH_SIZE]; // {keysym:Name} answers
+static int     g_keysymCached = 0;
+static int     g_keyNamesReady = 0;
+
+// FNV-1a over `len` bytes, optionally case-folded
+static unsigned keyname_hash(const char *s, size_t len, int fold)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)(fold ? tolower((unsigned char)s[i]) : s[i]);
+        h *= 16777619u;
+    }
+    return h & (KEYNAME_HASH_SIZE - 1);
+}
+
+// The slot holding `s` (len bytes), or the empty slot it would go in
+static KeyName *keyname_slot(KeyName *tab, const char *s, size_t len, int fold)
+{
+    for (unsigned h = keyname_hash(s, len, fold), n = 0; n < KEYNAME_HASH_SIZE; n++) {
+        KeyName *e = &tab[(h + n) & (KEYNAME_HASH_SIZE - 1)];
+        if (!e->name[0]) return e;
+        if (strlen(e->name) == len
+            && (fold ? strncasecmp(e->name, s, len) : strncmp(e->name, s, len)) == 0)
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void keyname_add(const char *name, KeySym sym)
+{
+    KeyName *e = keyname_slot(g_keyNames, name, strlen(name), 1);
+    if (e && !e->name[0]) {
+        snprintf(e->name, sizeof(e->name), "%s", name);
+        e->sym = sym;
+    }
+}
+
+static void keyname_init(void)
+{
+    for (int i = 0; g_keyAliases[i].name; i++) {
+        keyname_add(g_keyAliases[i].name, g_keyAliases[i].sym);
+    }
+    char name[8];
+    for (int n = 1; n <= 24; n++) {
+        snprintf(name, sizeof(name), "f%d", n);
+        keyname_add(name, XK_F1 + (n - 1));
+    }
+    for (int n = 0; n <= 9; n++) {
+        snprintf(name, sizeof(name), "kp%d", n);
+        keyname_add(name, XK_KP_0 + n);
+    }
+    g_keyNamesReady = 1;
+}
+
+// {name}: one of the aliases above, NoSymbol otherwise
+static KeySym keyname_lookup(const char *s, size_t len)
+{
+    if (!g_keyNamesReady) keyname_init();
+    if (len == 0 || len >= KEYNAME_MAX) return NoSymbol;
+    const KeyName *e = keyname_slot(g_keyNames, s, len, 1);
+    return e && e->name[0] ? e->sym : NoSymbol;
+}
+
+// {keysym:Name}: any X keysym name (case matters), NoSymbol if unknown
+static KeySym keysym_lookup(const char *s, size_t len)
+{
+    if (len == 0 || len >= KEYNAME_MAX) return NoSymbol;
+    KeyName *e = keyname_slot(g_keysymCache, s, len, 0);
+    if (e && e->name[0]) return e->sym;
+
+    char name[KEYNAME_MAX];
+    memcpy(name, s, len);
+    name[len] = '\0';
+    KeySym sym = XStringToKeysym(name);
+    if (e && 2 * (g_keysymCached + 1) <= KEYNAME_HASH_SIZE) {
+        memcpy(e->name, name, len + 1);
+        e->sym = sym;
+        g_keysymCached++;
+    }
+    return sym;
+}
+
+// Length of the [A-Za-z0-9_] run at text[idx] (up to len)
+static size_t keyname_span(const char *text, size_t len, size_t idx)
+{
+    size_t n = 0;
+    while (idx + n < len && (isalnum((unsigned char)text[idx + n]) || text[idx + n] == '_')) {
+        n++;
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------
+// parse_special_token: checks if the `len` bytes at `text` start with:
+//   - {name}, a key from the names above, e.g. {up}, {tab}, {F5}, {kp7}
+//   - {keysym:Name}, any X keysym, e.g. {keysym:XF86AudioPlay}
+//   - each can have :NNN hold time, e.g. {up:3000}, {keysym:KP_Enter:200}
+//   - {messageN} => splice in line #N from messages.txt
+// If recognized, returns the length of that token in the string. If not, 0.
+// Nothing is copied: the text need not be NUL-terminated.
+// ---------------------------------------------------------------------
+static int parse_special_token(MessageStore *msgs, const char *text, size_t len,
+                               TokenAction *out)
+{
+    if (len < 2 || text[0] != '{') return 0;
+
+    // 1) Check if it's {messageN}
+    if (len >= 8 && memcmp(text, "{message", 8) == 0) {
+        size_t idx = 8;
+        long   msgIndex;
+        if (parse_digits(text, len, &idx, &msgIndex) > 0 && idx < len && text[idx] == '}') {
+            const char *line;
+            size_t      lineLen;
+            if (msgIndex < 1 || message_line(msgs, (size_t)msgIndex, &line, &lineLen) < 0) {
+                LOG_WARN("{message%ld} out of range (1..%zu)", msgIndex, message_count(msgs));
+                return 0;
+            }
+            // valid line
+            out->sym     = 0;
+            out->holdMs  = 0;
+            out->msgLine = (size_t)msgIndex;
+            out->msgText = line;
+            out->msgLen  = lineLen;
+
+            LOG_SIM("Found token {message%ld} (%zu bytes)", msgIndex, lineLen);
+            return (int)idx + 1; // skip '}'
+        }
+        return 0;
+    }
+
+    // 2) If not {messageN}, a key name or {keysym:Name}
+    size_t idx     = 1;
+    size_t nameLen = keyname_span(text, len, idx);
+    KeySym sym;
+    if (nameLen == 6 && memcmp(&text[idx], "keysym", 6) == 0
+        && idx + 6 < len && text[idx + 6] == ':')
+    {
+        idx    += 7;
+        nameLen = keyname_span(text, len, idx);
+        sym     = keysym_lookup(&text[idx], nameLen);
+        if (sym == NoSymbol && nameLen > 0) {
+            LOG_WARN("Unknown keysym name \"%.*s\"", (int)nameLen, &text[idx]);
+        }
+    } else {
+        sym = keyname_lookup(&text[idx], nameLen);
+    }
+    if (sym == NoSymbol) return 0;
+    idx += nameLen;
+
+    long holdMs = 0;
+    if (idx < len && text[idx] == ':') {
+        // parse hold time
+        idx++;
+        parse_digits(text, len, &idx, &holdMs);
+    }
+    if (idx < len && text[idx] == '}') {
+        out->sym     = sym;
+        out->holdMs  = (int)holdMs;
+        out->msgLine = 0;
+        out->msgText = NULL;
+        out->msgLen  = 0;
+        return (int)idx + 1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------
+// EventPlan: the "Text to type" compiled once into a flat list of key
+// edges and waits. Loops replay the plan, so the tokenizer and the
+// {messageN} lookups only run once per simulate_typing call.
+// ---------------------------------------------------------------------
+enum {
+    PLAN_KEY_DOWN = 1,
+    PLAN_KEY_UP,
+    PLAN_WAIT,
+    PLAN_REMAP       // bind the scratch keycodes for chunk `arg` (takes no time)
+};
+
+#define PLAN_F_CHAR    0x01  // edge comes from a normal character, not a token
+#define PLAN_F_MOD     0x02  // modifier edge added so the key yields its KeySym
+#define PLAN_F_SCRATCH 0x04  // KeySym not in the layout, sent on a scratch keycode
+#define PLAN_W_DWELL   0x10  // wait: key held during a quick press (Dwell)
+#define PLAN_W_FLIGHT  0x20  // wait: gap after a release (Flight, or Rate)
+
+typedef struct {
+    uint8_t  kind;   // PLAN_KEY_DOWN / PLAN_KEY_UP / PLAN_WAIT / PLAN_REMAP
+    uint8_t  flags;  // PLAN_F_* for edges, PLAN_W_* for waits
+    uint16_t code;   // keycode for key edges
+    uint32_t arg;    // KeySym for key edges, milliseconds for fixed waits
+} PlanOp;
+
+// Where an op came from in the top-level text (for the progress pane)
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} PlanSrc;
+
+typedef struct {
+    PlanOp  *ops;
+    PlanSrc *src;        // parallel to ops
+    int      count;
+    int      cap;
+    unsigned keymapGen;  // keycodes are only valid for this keymap
+    PlanSrc  cur;        // top-level token being compiled
+    MessageStore *msgs;  // snapshot {messageN} resolves against (may be NULL)
+    KeySym  *remap;      // chunks rows of g_scratchCount: binding per chunk
+    int      chunks;     // 0 => no scratch keys in the plan
+    int64_t *at;         // plan_schedule: offset of each op from loop start (ns)
+    int64_t  loopNs;     // plan_schedule: length of one loop (ns)
+    int      keys;       // plan_schedule: key presses per loop (no modifiers)
+} EventPlan;
+
+// ---------------------------------------------------------------------
+// Typing speed. Dwell and flight are the defaults for every quick press;
+// a nonzero rate overrides flight so that presses start 1/rate apart.
+// ---------------------------------------------------------------------
+typedef struct {
+    int dwellMs;
+    int flightMs;
+    int rateKps;   // keys per second, 0 => dwell + flight
+} TypingTiming;
+
+static TypingTiming g_timing = { 30, 60, 0 };
+
+#define NS_PER_MS  1000000LL
+#define NS_PER_SEC 1000000000LL
+
+static void plan_free(EventPlan *plan)
+{
+    free(plan->ops);
+    free(plan->src);
+    free(plan->at);
+    free(plan->remap);
+    plan->ops    = NULL;
+    plan->src    = NULL;
+    plan->at     = NULL;
+    plan->remap  = NULL;
+    plan->chunks = 0;
+    plan->count  = 0;
+    plan->cap    = 0;
+    plan->loopNs = 0;
+}
+
+// Append one op. Back-to-back fixed waits are merged into a single wait.
+static int plan_push(EventPlan *plan, int kind, int flags, KeyCode code, uint32_t arg)
+{
+    if (kind == PLAN_WAIT && flags == 0) {
+        if (arg == 0) return 0;
+        const PlanOp *last = plan->count > 0 ? &plan->ops[plan->count - 1] : NULL;
+        if (last && last->kind == PLAN_WAIT && last->flags == 0) {
+            plan->ops[plan->count - 1].arg += arg;
+            return 0;
+        }
+    }
+    if (plan->count == plan->cap) {
+        int newCap = plan->cap ? plan->cap * 2 : 64;
+        PlanOp  *grown = realloc(plan->ops, (size_t)newCap * sizeof(PlanOp));
+        if (grown) plan->ops = grown;
+        PlanSrc *src   = grown ? realloc(plan->src, (size_t)newCap * sizeof(PlanSrc)) : NULL;
+        if (!src) {
+            LOG_WARN("Out of memory while compiling plan (%d ops)", plan->count);
+            return -1;
+        }
+        plan->src = src;
+        plan->cap = newCap;
+    }
+    plan->src[plan->count] = plan->cur;
+    PlanOp *op = &plan->ops[plan->count++];
+    op->kind  = (uint8_t)kind;
+    op->flags = (uint8_t)flags;
+    op->code  = code;
+    op->arg   = arg;
+    return 0;
+}
+
+// Fixed wait of `ms`, or a dwell/flight wait sized later by plan_schedule
+static int plan_push_wait(EventPlan *plan, int flags, int ms)
+{
+    return plan_push(plan, PLAN_WAIT, flags, 0, (uint32_t)ms);
+}
+
+// Press/release the modifier keys in `mods` (Shift, level 3) around a key
+static int plan_push_mods(EventPlan *plan, int kind, unsigned mods)
+{
+    for (int bit = 0; bit < 8; bit++) {
+        if (!(mods & (1u << bit))) continue;
+        KeyCode mc = g_modKeycode[bit];
+        if (plan_push(plan, kind, PLAN_F_MOD, mc, (uint32_t)g_modKeysym[bit]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------
+// plan_push_key: press `ks` with whatever modifiers the keymap needs,
+//   hold it for holdMs (0 => quick press, one dwell), release, one flight.
+// ---------------------------------------------------------------------
+static int plan_push_key(EventPlan *plan, const KeyEntry *ke, int flags, int holdMs)
+{
+    if (plan_push_mods(plan, PLAN_KEY_DOWN, ke->mods) < 0)                      return -1;
+    if (plan_push(plan, PLAN_KEY_DOWN, flags, ke->code, (uint32_t)ke->sym) < 0) return -1;
+    if (holdMs > 0) {
+        if (plan_push_wait(plan, 0, holdMs) < 0)                                return -1;
+    } else {
+        if (plan_push_wait(plan, PLAN_W_DWELL, 0) < 0)                          return -1;
+    }
+    if (plan_push(plan, PLAN_KEY_UP, flags, ke->code, (uint32_t)ke->sym) < 0)   return -1;
+    if (plan_push_mods(plan, PLAN_KEY_UP, ke->mods) < 0)                        return -1;
+    return plan_push_wait(plan, PLAN_W_FLIGHT, 0);
+}
+
+// Press `ks` from the layout if it is there, else on a scratch keycode
+// (given out by plan_bind_scratch). Unreachable KeySyms only warn.
+static int plan_push_sym(EventPlan *plan, KeySym ks, int flags, int holdMs)
+{
+    const KeyEntry *ke = keymap_lookup(ks);
+    if (ke) return plan_push_key(plan, ke, flags, holdMs);
+
+    if (ks == NoSymbol || g_scratchCount == 0) {
+        LOG_WARN("No key for KeySym=0x%lx", (unsigned long)ks);
+        return 0;
+    }
+    KeyEntry scratch = { .sym = ks, .code = 0, .mods = 0 };
+    return plan_push_key(plan, &scratch, flags | PLAN_F_SCRATCH, holdMs);
+}
+
+// ---------------------------------------------------------------------
+// Compiled {messageN} lines
+//   Each line is tokenized once per snapshot into its own op list, and
+//   every later use splices that list into the plan. The cache lives in
+//   the snapshot, so a reload starts it empty; entries compiled against
+//   an older keymap are rebuilt on their next use.
+// ---------------------------------------------------------------------
+struct MessageOps {
+    size_t   line;       // 1-based, 0 => free slot
+    unsigned keymapGen;  // g_keymapGen the ops were compiled against
+    int      count;
+    PlanOp  *ops;
+};
+
+static void message_ops_free(MessageStore *ms)
+{
+    for (size_t i = 0; i < ms->opsCap; i++) {
+        free(ms->opsTable[i].ops);
+    }
+    free(ms->opsTable);
+    ms->opsTable = NULL;
+    ms->opsCap   = 0;
+    ms->opsUsed  = 0;
+}
+
+// The slot holding `line`, or the free slot it would go in. Grows the
+// table first so it stays at most half full. NULL on allocation failure.
+static MessageOps *message_ops_slot(MessageStore *ms, size_t line)
+{
+    if (2 * (ms->opsUsed + 1) > ms->opsCap) {
+        size_t      newCap = ms->opsCap ? ms->opsCap * 2 : 16;
+        MessageOps *grown  = calloc(newCap, sizeof(*grown));
+        if (!grown) return NULL;
+        for (size_t i = 0; i < ms->opsCap; i++) {
+            const MessageOps *e = &ms->opsTable[i];
+            if (!e->line) continue;
+            size_t h = e->line & (newCap - 1);
+            while (grown[h].line) h = (h + 1) & (newCap - 1);
+            grown[h] = *e;
+        }
+        free(ms->opsTable);
+        ms->opsTable = grown;
+        ms->opsCap   = newCap;
+    }
+
+    size_t h = line & (ms->opsCap - 1);
+    while (ms->opsTable[h].line && ms->opsTable[h].line != line) {
+        h = (h + 1) & (ms->opsCap - 1);
+    }
+    return &ms->opsTable[h];
+}
+
+// The cached ops of line `n`, or NULL if it is not compiled against the
+// current keymap yet
+static const MessageOps *message_ops_find(MessageStore *ms, size_t n)
+{
+    if (!ms->opsCap) return NULL;
+    size_t h = n & (ms->opsCap - 1);
+    while (ms->opsTable[h].line) {
+        const MessageOps *e = &ms->opsTable[h];
+        if (e->line == n) return e->keymapGen == g_keymapGen ? e : NULL;
+        h = (h + 1) & (ms->opsCap - 1);
+    }
+    return NULL;
+}
+
+// Cache the ops compiled into `sub` for line `n`. Takes them over and
+// frees the rest of `sub` either way.
+static int message_ops_store(MessageStore *ms, size_t n, EventPlan *sub)
+{
+    PlanOp *fit = sub->count > 0
+                ? realloc(sub->ops, (size_t)sub->count * sizeof(PlanOp)) : NULL;
+    if (!fit) free(sub->ops);
+    free(sub->src);
+    int count = sub->count;
+    memset(sub, 0, sizeof(*sub));
+
+    MessageOps *e = count > 0 && !fit ? NULL : message_ops_slot(ms, n);
+    if (!e) {
+        free(fit);
+        LOG_WARN("Out of memory compiling {message%zu}", n);
+        return -1;
+    }
+    if (e->line == n) {
+        free(e->ops);  // compiled against an older keymap
+    } else {
+        ms->opsUsed++;
+    }
+    e->line      = n;
+    e->keymapGen = g_keymapGen;
+    e->count     = count;
+    e->ops       = fit;
+    LOG_SIM("Compiled {message%zu} => %d ops (cached)", n, count);
+    return 0;
+}
+
+// ---------------------------------------------------------------------
+// plan_compile_text:
+//   Tokenizes `text` once and appends its events to `plan`. {messageN}
+//   splices in the line's cached ops, so the plan has no expansions left.
+//
+//   A line that is not cached yet is compiled on an explicit stack, not
+//   by recursion: the line is pushed, compiled into its own op list and
+//   cached, and then the token that named it is read again and hits the
+//   cache. The stack holds at most g_maxExpandDepth lines. A line that is
+//   already on it is a cycle. Both are compile errors, so the run never
+//   starts.
+//   Returns 0 on success, -1 on error.
+// ---------------------------------------------------------------------
+typedef struct {
+    size_t      line;  // message line being compiled, 0 => top-level text
+    const char *text;  // that line, viewed in place (not NUL-terminated)
+    size_t      len;
+    size_t      pos;   // next byte to tokenize
+    EventPlan   sub;   // ops of the line (unused at the top level)
+} ExpandFrame;
+
+static int g_maxExpandDepth = 16;  // --max-depth: {messageN} nesting limit
+
+// Push line `n` (`text`, `len`) unless that would nest too deep or
+// revisit a line
+static int expand_push(ExpandFrame *stack, int *top, MessageStore *ms, size_t n,
+                       const char *text, size_t len)
+{
+    for (int k = 1; k <= *top; k++) {
+        if (stack[k].line != n) continue;
+        char   chain[256];
+        size_t used = 0;
+        for (int j = k; j <= *top && used < sizeof(chain); j++) {
+            used += (size_t)snprintf(chain + used, sizeof(chain) - used,
+                                     "{message%zu} -> ", stack[j].line);
+        }
+        if (used < sizeof(chain)) {
+            snprintf(chain + used, sizeof(chain) - used, "{message%zu}", n);
+        }
+        LOG_ERROR("{messageN} cycle: %s", chain);
+        return -1;
+    }
+    if (*top >= g_maxExpandDepth) {
+        LOG_ERROR("{message%zu} nests deeper than %d levels (--max-depth)",
+                  n, g_maxExpandDepth);
+        return -1;
+    }
+
+    ExpandFrame *fr = &stack[++*top];
+    memset(fr, 0, sizeof(*fr));
+    fr->line          = n;
+    fr->text          = text;
+    fr->len           = len;
+    fr->sub.msgs      = ms;
+    fr->sub.keymapGen = g_keymapGen;
+    return 0;
+}
+
+static int plan_compile_text(EventPlan *plan, const char *text, size_t len)
+{
+    ExpandFrame *stack = calloc((size_t)g_maxExpandDepth + 1, sizeof(*stack));
+    if (!stack) {
+        LOG_WARN("Out of memory while compiling plan");
+        return -1;
+    }
+    stack[0].text = text;
+    stack[0].len  = len;
+
+    int top = 0;
+    int rc  = 0;
+    while (rc == 0) {
+        ExpandFrame *fr  = &stack[top];
+        EventPlan   *out = top == 0 ? plan : &fr->sub;
+        const char  *t   = fr->text;
+        size_t       i   = fr->pos;
+
+        if (i == fr->len) {
+            if (top == 0) break;
+            // line done: cache it, then resume at the token that named it
+            rc = message_ops_store(plan->msgs, fr->line, &fr->sub);
+            top--;
+            continue;
+        }
+
+        TokenAction action;
+        int consumed = parse_special_token(plan->msgs, &t[i], fr->len - i, &action);
+        if (top == 0) {
+            plan->cur.off = (uint32_t)i;
+            plan->cur.len = consumed > 0 ? (uint32_t)consumed : 1;
+        }
+        if (consumed > 0) {
+            if (action.msgLine) {
+                // {messageN} => splice in the line's compiled ops
+                const MessageOps *mo = message_ops_find(plan->msgs, action.msgLine);
+                if (!mo) {
+                    rc = expand_push(stack, &top, plan->msgs, action.msgLine,
+                                     action.msgText, action.msgLen);
+                    continue;  // fr->pos stays on the token
+                }
+                for (int k = 0; k < mo->count && rc == 0; k++) {
+                    const PlanOp *op = &mo->ops[k];
+                    rc = plan_push(out, op->kind, op->flags, op->code, op->arg);
+                }
+            }
+            else {
+                // a single key press or hold
+                rc = plan_push_sym(out, action.sym, 0, action.holdMs);
+            }
+            fr->pos = i + consumed;
+        } else {
+            // normal character, ASCII straight from the byte table
+            KeySym sym;
+            int    used = utf8_keysym(&t[i], fr->len - i, &sym);
+            const KeyEntry *ke = used == 1 ? keymap_lookup_char((unsigned char)t[i]) : NULL;
+            if (top == 0) {
+                plan->cur.len = (uint32_t)used;
+            }
+            if (ke) {
+                rc = plan_push_key(out, ke, PLAN_F_CHAR, 0);
+            } else if (sym == NoSymbol) {
+                LOG_WARN("No key for byte 0x%02x", (unsigned)(unsigned char)t[i]);
+            } else {
+                rc = plan_push_sym(out, sym, PLAN_F_CHAR, 0);
+            }
+            fr->pos = i + (size_t)used;
+        }
+    }
+
+    for (; top > 0; top--) {
+        plan_free(&stack[top].sub);
+    }
+    free(stack);
+    return rc;
+}
+
+// Close a chunk: the slots it uses and their KeySyms (NoSymbol = any)
+static int plan_remap_row(EventPlan *plan, const KeySym *slot, const uint32_t *lastUse,
+                          uint32_t chunkStart)
+{
+    int     pool  = g_scratchCount;
+    KeySym *grown = realloc(plan->remap, (size_t)(plan->chunks + 1) * pool * sizeof(KeySym));
+    if (!grown) {
+        LOG_WARN("Out of memory binding scratch keys");
+        return -1;
+    }
+    plan->remap = grown;
+    KeySym *row = &grown[(size_t)plan->chunks * pool];
+    for (int s = 0; s < pool; s++) {
+        row[s] = lastUse[s] >= chunkStart ? slot[s] : NoSymbol;
+    }
+    plan->chunks++;
+    return 0;
+}
+
+// ---------------------------------------------------------------------
+// plan_bind_scratch:
+//   Gives every scratch key in the plan a keycode from the pool. Slots
+//   are reused least recently used first, so a repeated character keeps
+//   its binding. When a character needs a slot and every slot is taken
+//   by a character of the current chunk, a PLAN_REMAP op starts a new
+//   chunk. Replay binds a chunk's keycodes in one go when it reaches
+//   its op, and only the slots that differ from what the server has.
+//   Chunk 0 is bound before each loop.
+// ---------------------------------------------------------------------
+static int plan_bind_scratch(EventPlan *plan)
+{
+    int pool = g_scratchCount;
+    int any  = 0;
+    for (int i = 0; i < plan->count && !any; i++) {
+        any = (plan->ops[i].flags & PLAN_F_SCRATCH) && plan->ops[i].kind != PLAN_WAIT;
+    }
+    free(plan->remap);
+    plan->remap  = NULL;
+    plan->chunks = 0;
+    if (!any) return 0;
+
+    KeySym   slot[SCRATCH_MAX];     // binding as of this op
+    uint32_t lastUse[SCRATCH_MAX];
+    uint32_t stamp      = 0;
+    uint32_t chunkStart = 1;        // slots used since then belong to the chunk
+    for (int s = 0; s < pool; s++) {
+        slot[s]    = g_scratchBound[s] == SCRATCH_UNKNOWN ? NoSymbol : g_scratchBound[s];
+        lastUse[s] = 0;
+    }
+
+    EventPlan out;
+    memset(&out, 0, sizeof(out));
+    int rc = 0;
+    for (int i = 0; i < plan->count && rc == 0; i++) {
+        PlanOp op = plan->ops[i];
+        out.cur   = plan->src[i];
+        if ((op.flags & PLAN_F_SCRATCH) && op.kind != PLAN_WAIT) {
+            int k = -1;
+            for (int s = 0; s < pool && k < 0; s++) {
+                if (slot[s] == (KeySym)op.arg) k = s;
+            }
+            if (k < 0 && op.kind == PLAN_KEY_DOWN) {
+                // Free slots first, then the least recently used one
+                // not needed by this chunk; else a new chunk
+                for (int s = 0; s < pool; s++) {
+                    if (lastUse[s] >= chunkStart) continue;
+                    int freeS = slot[s] == NoSymbol;
+                    int freeK = k >= 0 && slot[k] == NoSymbol;
+                    if (k < 0 || freeS > freeK || (freeS == freeK && lastUse[s] < lastUse[k])) {
+                        k = s;
+                    }
+                }
+                if (k < 0) {
+                    rc = plan_remap_row(plan, slot, lastUse, chunkStart);
+                    if (rc == 0) rc = plan_push(&out, PLAN_REMAP, 0, 0, (uint32_t)plan->chunks);
+                    chunkStart = stamp + 1;
+                    k = 0;
+                    for (int s = 1; s < pool; s++) {
+                        if (lastUse[s] < lastUse[k]) k = s;
+                    }
+                }
+                slot[k] = (KeySym)op.arg;
+            }
+            if (k < 0) {
+                rc = -1;  // a release without its press; cannot happen
+                break;
+            }
+            lastUse[k] = ++stamp;
+            op.code    = g_scratchCode[k];
+        }
+        if (rc == 0) rc = plan_push(&out, op.kind, op.flags, op.code, op.arg);
+    }
+    if (rc == 0) rc = plan_remap_row(plan, slot, lastUse, chunkStart);
+    if (rc < 0) {
+        plan_free(&out);
+        return -1;
+    }
+
+    free(plan->ops);
+    free(plan->src);
+    plan->ops   = out.ops;
+    plan->src   = out.src;
+    plan->count = out.count;
+    plan->cap   = out.cap;
+    if (plan->chunks > 1) {
+        LOG_SIM("Scratch keys: %d chunks of up to %d characters", plan->chunks, pool);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------
+// plan_lower_mods:
+//   plan_push_key wraps every character in its own modifier presses.
+//   Where two characters in a row need the same modifier (Shift for
+//   "HELLO", level 3 for AltGr symbols), the release after the first and
+//   the press before the second are dropped, so the modifier stays held
+//   across the run and is released after its last character. Only plain
+//   characters separated by a flight are joined; tokens such as {up}
+//   never run with a stray modifier held.
+// ---------------------------------------------------------------------
+static void plan_lower_mods(EventPlan *plan)
+{
+    int      n    = plan->count;
+    PlanOp  *ops  = plan->ops;
+    uint8_t *drop = calloc((size_t)(n ? n : 1), 1);
+    if (!drop) return;  // the plan is still correct, just not lowered
+
+    int lastKey = -1;  // most recent non-modifier edge
+    for (int i = 0; i < n; i++) {
+        const PlanOp *op = &ops[i];
+        if (op->kind != PLAN_KEY_DOWN && op->kind != PLAN_KEY_UP) continue;
+        if (!(op->flags & PLAN_F_MOD)) {
+            lastKey = i;
+            continue;
+        }
+        if (op->kind != PLAN_KEY_UP || drop[i]
+            || lastKey < 0 || !(ops[lastKey].flags & PLAN_F_CHAR))
+        {
+            continue;
+        }
+
+        // Past the rest of the releases and the flight...
+        int j = i + 1;
+        while (j < n && ((ops[j].kind == PLAN_KEY_UP && (ops[j].flags & PLAN_F_MOD))
+                         || (ops[j].kind == PLAN_WAIT && ops[j].flags == PLAN_W_FLIGHT))) {
+            j++;
+        }
+        // ...to the presses of the next character
+        int k = j;
+        while (k < n && ops[k].kind == PLAN_KEY_DOWN && (ops[k].flags & PLAN_F_MOD)) k++;
+        if (k >= n || ops[k].kind != PLAN_KEY_DOWN || !(ops[k].flags & PLAN_F_CHAR)) continue;
+
+        for (int m = j; m < k; m++) {
+            if (!drop[m] && ops[m].code == op->code) {
+                drop[i] = drop[m] = 1;
+                break;
+            }
+        }
+    }
+
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (drop[i]) continue;
+        ops[kept]       = ops[i];
+        plan->src[kept] = plan->src[i];
+        kept++;
+    }
+    free(drop);
+    if (kept < n) {
+        LOG_SIM("Held modifiers across character runs (%d edges saved)", n - kept);
+    }
+    plan->count = kept;
+}
+
+// Compile `text` from scratch against the current keymap
+static int plan_compile(EventPlan *plan, const char *text)
+{
+    plan->count     = 0;
+    plan->keymapGen = g_keymapGen;
+    if (plan_compile_text(plan, text, strlen(text)) < 0) return -1;
+    plan_lower_mods(plan);
+    return plan_bind_scratch(plan);
+}
+
+// ---------------------------------------------------------------------
+// plan_schedule:
+//   Turns dwell/flight/fixed waits into an offset from loop start for
+//   every op. Replay sleeps until loopStart + at[i], so rounding and
+//   wakeup latency never accumulate over a long run.
+// ---------------------------------------------------------------------
+static int plan_schedule(EventPlan *plan, const TypingTiming *timing)
+{
+    int64_t dwell  = (int64_t)timing->dwellMs * NS_PER_MS;
+    int64_t flight = (int64_t)timing->flightMs * NS_PER_MS;
+    if (timing->rateKps > 0) {
+        int64_t period = NS_PER_SEC / timing->rateKps;
+        if (dwell >= period) {
+            LOG_WARN("Dwell %d ms leaves no room for %d keys/s",
+                     timing->dwellMs, timing->rateKps);
+        }
+        flight = period > dwell ? period - dwell : 0;
+    }
+
+    int64_t *at = realloc(plan->at, (size_t)(plan->count ? plan->count : 1) * sizeof(int64_t));
+    if (!at) {
+        LOG_WARN("Out of memory while scheduling plan (%d ops)", plan->count);
+        return -1;
+    }
+    plan->at = at;
+
+    int64_t t = 0;
+    plan->keys = 0;
+    for (int i = 0; i < plan->count; i++) {
+        const PlanOp *op = &plan->ops[i];
+        at[i] = t;
+        if (op->kind == PLAN_KEY_DOWN && !(op->flags & PLAN_F_MOD)) plan->keys++;
+        if (op->kind != PLAN_WAIT) continue;
+
+        if (op->flags & PLAN_W_DWELL) {
+            t += dwell;
+        } else if (op->flags & PLAN_W_FLIGHT) {
+            t += flight;
+        } else {
+            t += (int64_t)op->arg * NS_PER_MS;
+        }
+    }
+    plan->loopNs = t;
+    return 0;
+}
+
+// Number of key edges, for the summary line of a dump
+static int plan_edge_count(const EventPlan *plan)
+{
+    int edges = 0;
+    for (int i = 0; i < plan->count; i++) {
+        if (plan->ops[i].kind == PLAN_KEY_DOWN || plan->ops[i].kind == PLAN_KEY_UP) edges++;
+    }
+    return edges;
+}
+
+// Human readable listing of a scheduled plan, one op per line
+static void plan_dump(const EventPlan *plan, FILE *fp)
+{
+    fprintf(fp, "# %d ops, %d key edges, %.3f ms per loop\n",
+            plan->count, plan_edge_count(plan), plan->loopNs / 1e6);
+
+    for (int i = 0; i < plan->count; i++) {
+        const PlanOp *op = &plan->ops[i];
+        double atMs = plan->at[i] / 1e6;
+        if (op->kind == PLAN_WAIT) {
+            int64_t next = (i + 1 < plan->count) ? plan->at[i + 1] : plan->loopNs;
+            fprintf(fp, "%6d  %10.3f  WAIT  %.3f ms%s\n", i, atMs,
+                    (next - plan->at[i]) / 1e6,
+                    (op->flags & PLAN_W_DWELL)  ? " (dwell)"  :
+                    (op->flags & PLAN_W_FLIGHT) ? " (flight)" : "");
+            continue;
+        }
+        if (op->kind == PLAN_REMAP) {
+            fprintf(fp, "%6d  %10.3f  REMAP chunk %u\n", i, atMs, op->arg);
+            continue;
+        }
+        char        buf[16];
+        const char *name = keysym_name((KeySym)op->arg, buf, sizeof(buf));
+        fprintf(fp, "%6d  %10.3f  %-4s  kc=%-3u 0x%04x %s%s%s\n", i, atMs,
+                op->kind == PLAN_KEY_DOWN ? "DOWN" : "UP",
+                op->code, op->arg, name ? name : "?",
+                (op->flags & PLAN_F_CHAR) ? " (char)" :
+                (op->flags & PLAN_F_MOD)  ? " (mod)"  : "",
+                (op->flags & PLAN_F_SCRATCH) ? " (scratch)" : "");
+    }
+    for (int c = 0; c < plan->chunks; c++) {
+        fprintf(fp, "# chunk %d:", c);
+        for (int s = 0; s < g_scratchCount; s++) {
+            KeySym ks = plan->remap[(size_t)c * g_scratchCount + s];
+            if (ks != NoSymbol) fprintf(fp, " kc=%u 0x%lx", g_scratchCode[s], (unsigned long)ks);
+        }
+        fputc('\n', fp);
+    }
+}
+
+static int64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------
+// Event loops: each thread blocks in its own epoll set. The UI set
+// holds stdin, a signalfd for SIGINT/SIGTERM and the engine's event
+// queue; the engine set holds the X connection and the command queue.
+// Both carry a timerfd armed with an absolute deadline, so a wait ends
+// exactly on time or as soon as the other side has something to say.
+// ---------------------------------------------------------------------
+enum {
+    EV_STDIN   = 0x01,
+    EV_X       = 0x02,
+    EV_TIMER   = 0x04,
+    EV_SIGNAL  = 0x08,
+    EV_WAKE    = 0x10,  // the queue this loop consumes has messages
+    EV_INOTIFY = 0x20   // messages.txt changed
+};
+
+typedef struct EvLoop {
+    int      epollFd;
+    int      timerFd;
+    int      wakeFd;   // eventfd posted by the producing thread
+    Display *dpy;      // connection whose fd is in the set, if any
+} EvLoop;
+
+static EvLoop     g_uiLoop     = { -1, -1, -1, NULL };
+static EvLoop     g_engineLoop = { -1, -1, -1, NULL };
+static int        g_signalFd   = -1;
+static atomic_int g_quitRequested = 0;  // SIGINT/SIGTERM seen
+
+static int evloop_add(EvLoop *lp, int fd, int tag)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)tag };
+    return epoll_ctl(lp->epollFd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int evloop_open(EvLoop *lp)
+{
+    lp->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    lp->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    lp->wakeFd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (lp->epollFd < 0 || lp->timerFd < 0 || lp->wakeFd < 0
+        || evloop_add(lp, lp->timerFd, EV_TIMER) < 0
+        || evloop_add(lp, lp->wakeFd, EV_WAKE) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void evloop_close(EvLoop *lp)
+{
+    if (lp->wakeFd >= 0)  close(lp->wakeFd);
+    if (lp->timerFd >= 0) close(lp->timerFd);
+    if (lp->epollFd >= 0) close(lp->epollFd);
+    lp->wakeFd = lp->timerFd = lp->epollFd = -1;
+    lp->dpy = NULL;
+}
+
+// UI side: stdin (unless headless) plus SIGINT/SIGTERM through a
+// signalfd. Must run before any thread starts so they all inherit the
+// blocked signal mask.
+static int evloop_open_ui(int withStdin)
+{
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+
+    g_signalFd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (evloop_open(&g_uiLoop) < 0 || g_signalFd < 0
+        || (withStdin && evloop_add(&g_uiLoop, STDIN_FILENO, EV_STDIN) < 0)
+        || evloop_add(&g_uiLoop, g_signalFd, EV_SIGNAL) < 0)
+    {
+        return -1;
+    }
+    return sigprocmask(SIG_BLOCK, &sigs, NULL);
+}
+
+// Engine side: the X connection, so MappingNotify is handled while we wait
+static int evloop_open_engine(Display *dpy)
+{
+    if (evloop_open(&g_engineLoop) < 0
+        || (dpy && evloop_add(&g_engineLoop, ConnectionNumber(dpy), EV_X) < 0))
+    {
+        return -1;
+    }
+    g_engineLoop.dpy = dpy;
+    return 0;
+}
+
+// Block until the absolute CLOCK_MONOTONIC `deadline` (or forever if it
+// is negative) or until something in the set needs attention. Returns
+// the EV_* bits that fired. X events and signals are handled here.
+static int evloop_wait(EvLoop *lp, int64_t deadline)
+{
+    struct itimerspec its = {0};
+    if (deadline >= 0) {
+        its.it_value.tv_sec  = (time_t)(deadline / NS_PER_SEC);
+        its.it_value.tv_nsec = (long)(deadline % NS_PER_SEC);
+    }
+    timerfd_settime(lp->timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+
+    // Xlib may already hold events it read off the socket
+    int fired = 0;
+    if (lp->dpy && XEventsQueued(lp->dpy, QueuedAlready) > 0) {
+        fired |= EV_X;
+    } else {
+        struct epoll_event evs[6];
+        int n = epoll_wait(lp->epollFd, evs, 6, -1);
+        for (int i = 0; i < n; i++) {
+            fired |= (int)evs[i].data.u32;
+        }
+    }
+
+    uint64_t count;
+    if (fired & EV_TIMER) {
+        while (read(lp->timerFd, &count, sizeof(count)) > 0) { }
+    }
+    if (fired & EV_WAKE) {
+        while (read(lp->wakeFd, &count, sizeof(count)) > 0) { }
+    }
+    if (fired & EV_SIGNAL) {
+        struct signalfd_siginfo si;
+        while (read(g_signalFd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+            LOG_WARN("Signal %u received => quitting", si.ssi_signo);
+            atomic_store(&g_quitRequested, 1);
+        }
+    }
+    if ((fired & EV_X) && lp->dpy) {
+        keymap_sync(lp->dpy);
+    }
+    if (fired & EV_INOTIFY) {
+        message_watch_events();
+    }
+    return fired;
+}
+
+// ---------------------------------------------------------------------
+// Engine queues:
+//   The UI and the typing engine run on separate threads and talk only
+//   through two lock-free single-producer/single-consumer rings of
+//   EngineMsg: commands go UI => engine, progress events come back.
+//   A push wakes the consumer's epoll set through its eventfd.
+// ---------------------------------------------------------------------
+enum {
+    // UI => engine
+    ENG_CMD_START,      // text, loops, delays, timing, batchMs
+    ENG_CMD_STOP,
+    ENG_CMD_PAUSE,      // toggles
+    ENG_CMD_RATE,       // timing.rateKps, from the next loop on
+    ENG_CMD_DUMP,       // text, timing => planXtest.txt
+    ENG_CMD_QUIT,
+    // engine => UI
+    ENG_EV_RUNNING,     // loops
+    ENG_EV_PAUSED,
+    ENG_EV_RESUMED,
+    ENG_EV_IDLE         // run (or plan dump) finished or stopped; result
+};
+
+// How a run ended (ENG_EV_IDLE)
+enum {
+    RUN_DONE,           // every loop typed
+    RUN_STOPPED,        // F2, a signal or a failed recompile mid-run
+    RUN_FAILED          // the text did not compile; nothing typed
+};
+
+typedef struct EngineMsg {
+    int          kind;
+    int          loops;
+    int          result;        // RUN_* for ENG_EV_IDLE
+    int          startDelayMs;
+    int          loopDelayMs;
+    int          batchMs;
+    TypingTiming timing;
+    char        *text;          // malloc'd; the receiver frees it
+} EngineMsg;
+
+#define ENGINE_QUEUE_LEN 64  // power of two
+
+typedef struct EngineQueue {
+    EngineMsg     slots[ENGINE_QUEUE_LEN];
+    atomic_size_t head;      // written by the producer only
+    atomic_size_t tail;      // written by the consumer only
+    EvLoop       *consumer;  // whose wakeFd to poke
+} EngineQueue;
+
+static EngineQueue g_cmdQueue   = { .consumer = &g_engineLoop };
+static EngineQueue g_eventQueue = { .consumer = &g_uiLoop };
+
+// Returns 0, or -1 if the ring is full (the message is not sent)
+static int engine_queue_push(EngineQueue *q, const EngineMsg *m)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail >= ENGINE_QUEUE_LEN) return -1;
+
+    q->slots[head & (ENGINE_QUEUE_LEN - 1)] = *m;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    uint64_t one = 1;
+    if (write(q->consumer->wakeFd, &one, sizeof(one)) < 0) {
+        // Counter can only overflow if nobody reads it; the ring still has it
+    }
+    return 0;
+}
+
+static int engine_queue_pop(EngineQueue *q, EngineMsg *m)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail == head) return 0;
+
+    *m = q->slots[tail & (ENGINE_QUEUE_LEN - 1)];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+// Engine => UI progress event
+static void engine_post(int kind, int loops)
+{
+    EngineMsg m = { .kind = kind, .loops = loops };
+    engine_queue_push(&g_eventQueue, &m);
+}
+
+static void engine_post_idle(int result)
+{
+    EngineMsg m = { .kind = ENG_EV_IDLE, .result = result };
+    engine_queue_push(&g_eventQueue, &m);
+}
+
+// ---------------------------------------------------------------------
+// Run progress: written by the engine with relaxed atomic stores as it
+// goes (no syscalls, no locks), sampled by the UI at its own frame rate.
+// ---------------------------------------------------------------------
+typedef struct {
+    atomic_int       loop;        // 1-based loop being typed
+    atomic_int       loops;
+    atomic_long      keysSent;    // key presses so far this run
+    atomic_long      keysTotal;   // key presses the whole run will send
+    atomic_uint      srcOff;      // token being typed, as a span of the
+    atomic_uint      srcLen;      //   text the run was started with
+    atomic_llong     typingNs;    // when the first loop began (backend clock)
+    atomic_llong     pausedNs;    // time spent paused since then
+    atomic_llong     pauseFromNs; // nonzero while paused: since when
+    atomic_llong     endNs;       // planned end of the run (backend clock)
+    atomic_llong     doneNs;      // when the run actually ended, 0 before (backend clock)
+    atomic_llong     loopNs;      // current schedule: one loop
+    atomic_int       loopKeys;    //   and its key presses
+} RunProgress;
+
+static RunProgress g_progress;
+
+#define PROGRESS_SET(field, v) atomic_store_explicit(&g_progress.field, (v), memory_order_relaxed)
+#define PROGRESS_GET(field)    atomic_load_explicit(&g_progress.field, memory_order_relaxed)
+
+// ---------------------------------------------------------------------
+// Engine-side command handling while a run is in progress. Pause only
+// takes hold at a pause point, where no key is down, and every deadline
+// after it moves by the time spent paused.
+// ---------------------------------------------------------------------
+static int g_pauseRequested = 0;   // engine thread only
+static int g_pendingRate    = -1;  // new Rate for the next loop, or -1
+static int g_engineQuit     = 0;   // engine thread only
+
+static void engine_poll_commands(void)
+{
+    EngineMsg m;
+    while (engine_queue_pop(&g_cmdQueue, &m)) {
+        switch (m.kind) {
+        case ENG_CMD_STOP:
+            LOG_INFO("Stop requested => aborting run");
+            g_stopRequested = 1;
+            break;
+        case ENG_CMD_QUIT:
+            g_stopRequested = 1;
+            g_engineQuit    = 1;
+            break;
+        case ENG_CMD_PAUSE:
+            g_pauseRequested = !g_pauseRequested;
+            break;
+        case ENG_CMD_RATE:
+            g_pendingRate = m.timing.rateKps;
+            LOG_INFO("Rate => %d keys/s from the next loop", g_pendingRate);
+            break;
+        default:
+            LOG_WARN("Engine busy, command ignored (stop the run first)");
+            break;
+        }
+        free(m.text);
+    }
+}
+
+// Sleep until the absolute CLOCK_MONOTONIC `deadline`, handling commands
+// the moment they arrive. Returns nonzero if a stop was requested. On a
+// virtual clock the deadline is simply reached.
+static int sim_sleep_until(int64_t deadline)
+{
+    if (g_backend->advance) {
+        g_backend->advance(deadline);
+        return g_stopRequested;
+    }
+    while (!g_stopRequested) {
+        if (mono_ns() >= deadline) break;
+        if (evloop_wait(&g_engineLoop, deadline) & EV_WAKE) {
+            engine_poll_commands();
+        }
+    }
+    return g_stopRequested;
+}
+
+// Block while paused; returns how long that was (0 if not paused)
+static int64_t engine_pause_point(void)
+{
+    if (!g_pauseRequested || g_stopRequested) return 0;
+
+    int64_t from = mono_ns();
+    PROGRESS_SET(pauseFromNs, from);
+    LOG_INFO("Paused");
+    engine_post(ENG_EV_PAUSED, 0);
+    while (g_pauseRequested && !g_stopRequested) {
+        if (evloop_wait(&g_engineLoop, -1) & EV_WAKE) {
+            engine_poll_commands();
+        }
+    }
+    int64_t paused = mono_ns() - from;
+    PROGRESS_SET(pausedNs, PROGRESS_GET(pausedNs) + paused);
+    PROGRESS_SET(endNs, PROGRESS_GET(endNs) + paused);
+    PROGRESS_SET(pauseFromNs, 0);
+    LOG_INFO("Resumed after %.3f s", paused / 1e9);
+    engine_post(ENG_EV_RESUMED, 0);
+    return paused;
+}
+
+// ---------------------------------------------------------------------
+// Scratch keycodes
+//   A chunk's binding goes out as one XChangeKeyboardMapping per run of
+//   neighbouring keycodes that differ from what the server has, then
+//   one XSync so the keys that follow see it. Slots already bound right
+//   cost nothing. On exit every slot we touched is emptied again.
+//   Backends that are not XTest never touch the server: they get one
+//   bind() call per slot that changes in g_scratchModel instead.
+// ---------------------------------------------------------------------
+// want[s]: the KeySym for slot s; NoSymbol leaves it alone and
+// SCRATCH_UNKNOWN empties it
+static int scratch_differs(const KeySym *bound, const KeySym *want, int s)
+{
+    if (want[s] == NoSymbol)        return 0;
+    if (want[s] == SCRATCH_UNKNOWN) return bound[s] != NoSymbol;
+    return want[s] != bound[s];
+}
+
+static void scratch_model_set(const KeySym *want)
+{
+    for (int s = 0; s < g_scratchCount; s++) {
+        if (!scratch_differs(g_scratchModel, want, s)) continue;
+        g_scratchModel[s] = want[s] == SCRATCH_UNKNOWN ? NoSymbol : want[s];
+        g_backend->bind(g_scratchCode[s], g_scratchModel[s]);
+    }
+}
+
+static void scratch_set(Display *dpy, const KeySym *want)
+{
+    int changed = 0;
+    for (int s = 0; s < g_scratchCount; ) {
+        if (!scratch_differs(g_scratchBound, want, s)) {
+            s++;
+            continue;
+        }
+        // Two columns so the key gives the same KeySym with Shift
+        KeySym syms[2 * SCRATCH_MAX];
+        int    e = s;
+        do {
+            syms[2 * (e - s)]     = want[e] == SCRATCH_UNKNOWN ? NoSymbol : want[e];
+            syms[2 * (e - s) + 1] = syms[2 * (e - s)];
+            g_scratchBound[e]     = want[e] == SCRATCH_UNKNOWN ? NoSymbol : want[e];
+            e++;
+        } while (e < g_scratchCount && g_scratchCode[e] == g_scratchCode[e - 1] + 1
+                 && scratch_differs(g_scratchBound, want, e));
+        XChangeKeyboardMapping(dpy, g_scratchCode[s], 2, syms, e - s);
+        changed += e - s;
+        s = e;
+    }
+    if (changed > 0) {
+        XSync(dpy, False);
+        LOG_DEBUG("Rebound %d scratch keycode(s)", changed);
+    }
+}
+
+static void scratch_apply(Display *dpy, const EventPlan *plan, int chunk)
+{
+    if (chunk >= plan->chunks) return;
+    const KeySym *row = &plan->remap[(size_t)chunk * g_scratchCount];
+    if (g_backend->bind) {
+        scratch_model_set(row);
+    } else {
+        scratch_set(dpy, row);
+    }
+}
+
+// Put the spare keycodes back the way we found them (empty)
+static void scratch_restore(Display *dpy)
+{
+    KeySym want[SCRATCH_MAX];
+    for (int s = 0; s < g_scratchCount; s++) {
+        want[s] = g_scratchBound[s] != NoSymbol ? SCRATCH_UNKNOWN : NoSymbol;
+    }
+    scratch_set(dpy, want);
+}
+
+// UI side: the next key, or UI_NO_KEY once the wait ended for another
+// reason (an engine event or the redraw deadline). ERR means quit.
+#define UI_NO_KEY (-2)
+
+static int ui_wait_key(WINDOW *win, int64_t deadline)
+{
+    if (atomic_load(&g_quitRequested)) return ERR;
+
+    int ch = wgetch(win);
+    if (ch != ERR) return ch;
+
+    evloop_wait(&g_uiLoop, deadline);
+    if (atomic_load(&g_quitRequested)) return ERR;
+    ch = wgetch(win);
+    return ch == ERR ? UI_NO_KEY : ch;
+}
+
+// SIM trace for the key-down at ops[i]. A token's hold ({up:10}) is the
+// plain wait right after its down edge; a quick press waits for Dwell.
+static void trace_key_down(const EventPlan *plan, int i)
+{
+    const PlanOp *op   = &plan->ops[i];
+    const PlanOp *next = i + 1 < plan->count ? &plan->ops[i + 1] : NULL;
+    if ((op->flags & PLAN_F_CHAR) && op->arg < 0x80) {
+        TRACE_SIM("Sending char '%c'", (int)op->arg);
+    } else if (op->flags & PLAN_F_CHAR) {
+        TRACE_SIM("Sending char U+%04X", (unsigned)(op->arg & 0xffffff));
+    } else if (op->flags & PLAN_F_MOD) {
+        return;
+    } else if (next && next->kind == PLAN_WAIT && next->flags == 0 && next->arg > 0) {
+        TRACE_SIM("Holding KeySym=0x%lx for %u ms", (unsigned long)op->arg, (unsigned)next->arg);
+    } else {
+        TRACE_SIM("Quick press KeySym=0x%lx", (unsigned long)op->arg);
+    }
+}
+
+// ---------------------------------------------------------------------
+// plan_replay:
+//   Sends one loop worth of the scheduled plan, starting at the absolute
+//   time `t0`. Every edge due within the batch window of the first one
+//   goes out in the same group, with a single flush. Keys still held
+//   when F2 arrives are released before returning. A pause is honoured
+//   between groups while no key is down; returns the time spent paused.
+// ---------------------------------------------------------------------
+static int64_t plan_replay(Display *dpy, const EventPlan *plan, int64_t t0)
+{
+    uint8_t held[32]  = {0}; // one bit per keycode currently down
+    int     heldCount = 0;
+    int64_t window    = (int64_t)g_batchWindowMs * NS_PER_MS;
+    int64_t paused    = 0;
+    int     i         = 0;
+
+    while (i < plan->count && !g_stopRequested) {
+        if (plan->ops[i].kind == PLAN_WAIT) {
+            i++;
+            continue;
+        }
+        if (heldCount == 0) {
+            int64_t p = engine_pause_point();
+            t0     += p;
+            paused += p;
+        }
+        if (sim_sleep_until(t0 + plan->at[i])) break;
+
+        int64_t groupEnd = plan->at[i] + window;
+        for (; i < plan->count && plan->at[i] <= groupEnd; i++) {
+            const PlanOp *op = &plan->ops[i];
+            if (op->kind == PLAN_KEY_DOWN) {
+                trace_key_down(plan, i);
+                if (!(op->flags & PLAN_F_MOD)) {
+                    atomic_fetch_add_explicit(&g_progress.keysSent, 1, memory_order_relaxed);
+                    PROGRESS_SET(srcOff, plan->src[i].off);
+                    PROGRESS_SET(srcLen, plan->src[i].len);
+                }
+                pressKeyDown(op->code, op->arg);
+                if (!(held[op->code >> 3] & (1u << (op->code & 7)))) heldCount++;
+                held[op->code >> 3] |= (uint8_t)(1u << (op->code & 7));
+            } else if (op->kind == PLAN_KEY_UP) {
+                pressKeyUp(op->code, op->arg);
+                if (held[op->code >> 3] & (1u << (op->code & 7))) heldCount--;
+                held[op->code >> 3] &= (uint8_t)~(1u << (op->code & 7));
+            } else if (op->kind == PLAN_REMAP) {
+                // Keys before the remap must go out with the old binding
+                flushKeys();
+                scratch_apply(dpy, plan, (int)op->arg);
+            }
+        }
+        flushKeys();
+    }
+
+    // Never leave a key stuck down after an abort
+    for (int kc = 0; kc < 256; kc++) {
+        if (held[kc >> 3] & (1u << (kc & 7))) {
+            pressKeyUp((KeyCode)kc, NoSymbol);
+        }
+    }
+    flushKeys();
+    return paused;
+}
+
+// ---------------------------------------------------------------------
+// Server-paced replay:
+//   XTestFakeKeyEvent's `delay` argument makes the X server wait before
+//   each edge, so a timed burst of edges goes out in one write and the
+//   client only wakes up once per burst. Bursts run on their own
+//   connection, kept PACED_LOOKAHEAD_MS ahead of the clock. On F2 the
+//   main connection kills that client, which drops whatever is still
+//   queued, and releases the keys that are still down on the server.
+//   A pause (F6) cuts the burst short at the next point where no key is
+//   down and takes hold once the server has played it out.
+// ---------------------------------------------------------------------
+#define PACED_LOOKAHEAD_MS 500
+#define PACED_SLACK_MS     2    // server delays are rounded to whole ms
+
+static atomic_int      g_serverPaced = 0;    // F5 toggles, read per loop
+static Display        *g_pacedDpy    = NULL; // connection carrying delayed edges
+static Pixmap          g_pacedHandle = None; // resource to XKillClient it by
+static XIOErrorHandler g_prevIOError = NULL;
+
+// The killed burst connection is expected to die; anything else is fatal
+static int paced_io_error(Display *d)
+{
+    if (d == g_pacedDpy) return 0;
+    return g_prevIOError ? g_prevIOError(d) : 0;
+}
+
+static void paced_io_exit(Display *d, void *unused)
+{
+    (void)d;
+    (void)unused;
+}
+
+static int paced_open(Display *dpy)
+{
+    if (g_pacedDpy) return 1;
+
+    g_pacedDpy = XOpenDisplay(DisplayString(dpy));
+    if (!g_pacedDpy) {
+        LOG_WARN("Could not open burst connection, using client pacing");
+        return 0;
+    }
+    if (!g_prevIOError) {
+        g_prevIOError = XSetIOErrorHandler(paced_io_error);
+    }
+    XSetIOErrorExitHandler(g_pacedDpy, paced_io_exit, NULL);
+    g_pacedHandle = XCreatePixmap(g_pacedDpy, DefaultRootWindow(g_pacedDpy), 1, 1, 1);
+    XSync(g_pacedDpy, False);
+    return 1;
+}
+
+static void paced_close(void)
+{
+    if (!g_pacedDpy) return;
+    XCloseDisplay(g_pacedDpy);
+    g_pacedDpy    = NULL;
+    g_pacedHandle = None;
+}
+
+// Drop the queued burst and release the keys it left down. The server
+// keeps the schedule, so the edges of ops [0, queued) due before the
+// kill have played and later ones were dropped. Near the cut a press
+// counts as played and a release as dropped, so no key stays down.
+static void paced_cancel(Display *dpy, const EventPlan *plan, int queued, int64_t t0)
+{
+    XKillClient(dpy, g_pacedHandle);
+    XSync(dpy, False);
+    int64_t cut   = mono_ns() - t0;
+    int64_t slack = PACED_SLACK_MS * NS_PER_MS;
+
+    uint8_t down[32] = {0};
+    for (int j = 0; j < queued; j++) {
+        const PlanOp *op  = &plan->ops[j];
+        uint8_t       bit = (uint8_t)(1u << (op->code & 7));
+        if (op->kind == PLAN_KEY_DOWN && plan->at[j] <= cut + slack) {
+            down[op->code >> 3] |= bit;
+        } else if (op->kind == PLAN_KEY_UP && plan->at[j] <= cut - slack) {
+            down[op->code >> 3] &= (uint8_t)~bit;
+        }
+    }
+
+    int released = 0;
+    for (int kc = 0; kc < 256; kc++) {
+        if (down[kc >> 3] & (1u << (kc & 7))) {
+            pressKeyUp((KeyCode)kc, NoSymbol);
+            released++;
+        }
+    }
+    XSync(dpy, False);
+    g_batchPending = 0;
+    g_flushCount++;
+    paced_close();
+    LOG_SIM("Burst cancelled, %d key(s) released", released);
+}
+
+// Server delays are whole milliseconds; rounding each absolute offset
+// (not each gap) keeps the burst from drifting against the schedule.
+static uint32_t plan_at_ms(const EventPlan *plan, int i)
+{
+    return (uint32_t)((plan->at[i] + NS_PER_MS / 2) / NS_PER_MS);
+}
+
+// Returns how far pauses moved the schedule, like plan_replay
+static int64_t plan_replay_paced(Display *dpy, const EventPlan *plan, int64_t t0)
+{
+    uint8_t  down[32]  = {0}; // key state once every queued edge has played
+    int      downCount = 0;
+    uint32_t lastMs    = 0;   // schedule time of the last queued edge
+    int64_t  shift     = 0;
+    int      i         = 0;
+
+    // The server starts counting delays when the first burst arrives
+    if (sim_sleep_until(t0)) return 0;
+
+    while (i < plan->count && !g_stopRequested) {
+        if (g_pauseRequested && downCount == 0) {
+            // XSync on the burst connection returns once the server has
+            // worked through its delays, i.e. every queued edge played
+            XSync(g_pacedDpy, False);
+            if (engine_pause_point() > 0) {
+                // The next delay counts from when it arrives: re-anchor
+                // so it keeps its gap to the last edge played
+                int64_t anchor = mono_ns() - (int64_t)lastMs * NS_PER_MS;
+                shift += anchor - t0;
+                t0     = anchor;
+            }
+            if (g_stopRequested) break;
+        }
+
+        // Queue one burst: everything due up to PACED_LOOKAHEAD_MS past now
+        int64_t horizon = mono_ns() - t0 + PACED_LOOKAHEAD_MS * NS_PER_MS;
+        int     edges   = 0;
+        for (; i < plan->count && plan->at[i] < horizon; i++) {
+            const PlanOp *op = &plan->ops[i];
+            if (op->kind != PLAN_KEY_DOWN && op->kind != PLAN_KEY_UP) continue;
+            // A pending pause ends the burst where no key is down
+            if (g_pauseRequested && downCount == 0 && edges > 0) break;
+
+            if (op->kind == PLAN_KEY_DOWN) {
+                trace_key_down(plan, i);
+                if (!(down[op->code >> 3] & (1u << (op->code & 7)))) downCount++;
+                down[op->code >> 3] |= (uint8_t)(1u << (op->code & 7));
+                if (!(op->flags & PLAN_F_MOD)) {
+                    // Counted when queued, up to one lookahead early
+                    atomic_fetch_add_explicit(&g_progress.keysSent, 1, memory_order_relaxed);
+                    PROGRESS_SET(srcOff, plan->src[i].off);
+                    PROGRESS_SET(srcLen, plan->src[i].len);
+                }
+            } else if (down[op->code >> 3] & (1u << (op->code & 7))) {
+                down[op->code >> 3] &= (uint8_t)~(1u << (op->code & 7));
+                downCount--;
+            }
+            uint32_t atMs = plan_at_ms(plan, i);
+            XTestFakeKeyEvent(g_pacedDpy, op->code, op->kind == PLAN_KEY_DOWN, atMs - lastMs);
+            lastMs = atMs;
+            edges++;
+        }
+        if (edges > 0) {
+            XFlush(g_pacedDpy);
+            g_edgeCount += (unsigned long)edges;
+            g_flushCount++;
+        }
+
+        // Come back when half of the lookahead has been played out
+        if (i < plan->count && !(g_pauseRequested && downCount == 0)) {
+            sim_sleep_until(t0 + plan->at[i] - PACED_LOOKAHEAD_MS / 2 * NS_PER_MS);
+        }
+    }
+
+    if (g_stopRequested) {
+        paced_cancel(dpy, plan, i, t0);
+    }
+    return shift;
+}
+
+// Publish the schedule for loop `l` (0-based) onwards, starting at loopStart
+static void progress_schedule(const EventPlan *plan, int l, int loops,
+                              int64_t loopStart, int loopDelay_ms, int64_t paused)
+{
+    int left = loops - l;
+    PROGRESS_SET(loop, l + 1);
+    PROGRESS_SET(loopNs, plan->loopNs);
+    PROGRESS_SET(loopKeys, plan->keys);
+    PROGRESS_SET(pausedNs, paused);
+    PROGRESS_SET(keysTotal, PROGRESS_GET(keysSent) + (long)plan->keys * left);
+    PROGRESS_SET(endNs, loopStart + left * plan->loopNs
+                        + (int64_t)(left - 1) * loopDelay_ms * NS_PER_MS);
+}
+
+// ---------------------------------------------------------------------
+// Dry run export (--dry-run FILE)
+//   Writes the edges the dryrun backend recorded, one per line, with
+//   their offset from the start of the run and the KeySym the plan
+//   sends. A spare keycode being rebound shows up as a "remap" line.
+//   A name ending in .jsonl or .json gets JSON lines, anything else CSV:
+//     t_ms,keycode,keysym,edge
+//     3000.000000,50,Shift_L,down
+//     3000.000000,43,H,down
+// ---------------------------------------------------------------------
+static const char *g_dryRunPath = NULL;
+
+static void dryrun_export(const char *path)
+{
+    static const char *const kinds[] = { "up", "down", "remap" };
+
+    size_t len  = strlen(path);
+    int    json = (len > 6 && strcmp(path + len - 6, ".jsonl") == 0)
+               || (len > 5 && strcmp(path + len - 5, ".json") == 0);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        LOG_ERROR("Could not open %s for writing", path);
+        return;
+    }
+    if (!json) fputs("t_ms,keycode,keysym,edge\n", fp);
+    size_t edges = 0;
+    for (size_t i = 0; i < g_recCount; i++) {
+        char                buf[16];
+        const RecordedEdge *e    = &g_recEdges[i];
+        int64_t             at   = e->atNs - g_recStartNs;
+        const char         *name = e->sym != NoSymbol ? keysym_name(e->sym, buf, sizeof(buf)) : NULL;
+        if (!name) name = e->kind == REC_BIND ? "NoSymbol" : "";
+        if (e->kind != REC_BIND) edges++;
+        if (json) {
+            fprintf(fp, "{\"t_ms\":%lld.%06lld,\"keycode\":%u,\"keysym\":\"%s\",\"edge\":\"%s\"}\n",
+                    (long long)(at / NS_PER_MS), (long long)(at % NS_PER_MS), e->code, name,
+                    kinds[e->kind]);
+        } else {
+            fprintf(fp, "%lld.%06lld,%u,%s,%s\n",
+                    (long long)(at / NS_PER_MS), (long long)(at % NS_PER_MS), e->code, name,
+                    kinds[e->kind]);
+        }
+    }
+    int failed = ferror(fp);
+    if (fclose(fp) != 0 || failed) {
+        LOG_ERROR("Could not write dry run to %s", path);
+        return;
+    }
+    int64_t span = g_recCount ? g_recEdges[g_recCount - 1].atNs - g_recStartNs : 0;
+    LOG_INFO("Dry run: %zu key edges and %zu remaps over %.3f s of planned time written to %s",
+             edges, g_recCount - edges, span / 1e9, path);
+}
+
+// ---------------------------------------------------------------------
+// simulate_typing: does multiple loops, with start & loop delays.
+//   Returns RUN_DONE, RUN_STOPPED or RUN_FAILED.
+// ---------------------------------------------------------------------
+static int simulate_typing(Display *dpy, const char *text,
+                           int loops, int startDelay_ms, int loopDelay_ms)
+{
+    LOG_SIM("StartDelay=%d, LoopDelay=%d, Loops=%d, text='%s'",
+            startDelay_ms, loopDelay_ms, loops, text);
+    LOG_SIM("Dwell=%d ms, Flight=%d ms, Rate=%d keys/s",
+            g_timing.dwellMs, g_timing.flightMs, g_timing.rateKps);
+
+    g_stopRequested  = 0; // reset before we begin
+    g_pauseRequested = 0;
+    g_pendingRate    = -1;
+
+    // Compile once, replay for every loop. The whole run (recompiles
+    // included) sees one messages.txt snapshot, even if it is reloaded.
+    keymap_sync(dpy);
+    memcpy(g_scratchModel, g_scratchBound, sizeof(g_scratchModel));
+    EventPlan plan = { .msgs = message_acquire() };
+    if (plan_compile(&plan, text) < 0 || plan_schedule(&plan, &g_timing) < 0) {
+        LOG_SIM("Could not compile text, nothing typed.");
+        plan_free(&plan);
+        message_release();
+        return RUN_FAILED;
+    }
+    LOG_SIM("Compiled plan with %d ops, %.3f ms per loop",
+            plan.count, plan.loopNs / 1e6);
+
+    // Every loop starts at an absolute deadline derived from runStart
+    record_clear();
+    int64_t runStart  = g_backend->now();
+    int64_t loopStart = runStart + (int64_t)startDelay_ms * NS_PER_MS;
+    int64_t planned   = loopStart - runStart;
+    int64_t paused    = 0;
+
+    PROGRESS_SET(loops, loops);
+    PROGRESS_SET(keysSent, 0);
+    PROGRESS_SET(srcLen, 0);
+    PROGRESS_SET(typingNs, loopStart);
+    PROGRESS_SET(doneNs, 0);
+    progress_schedule(&plan, 0, loops, loopStart, loopDelay_ms, 0);
+
+    if (startDelay_ms > 0) {
+        LOG_SIM("Sleeping %d ms before typing...", startDelay_ms);
+        if (sim_sleep_until(loopStart)) {
+            LOG_SIM("Aborted before typing began.");
+        }
+    }
+
+    for (int l = 0; l < loops; l++) {
+        int64_t p = engine_pause_point();
+        loopStart += p;
+        paused    += p;
+        if (g_stopRequested) break;
+
+        // Keycodes in the plan go stale if the keyboard mapping changed
+        keymap_sync(dpy);
+        if (plan.keymapGen != g_keymapGen) {
+            LOG_INFO("Keyboard mapping changed, recompiling plan");
+            if (plan_compile(&plan, text) < 0 || plan_schedule(&plan, &g_timing) < 0) {
+                g_stopRequested = 1;
+                break;
+            }
+        }
+        if (g_pendingRate >= 0) {
+            g_timing.rateKps = g_pendingRate;
+            g_pendingRate    = -1;
+            if (plan_schedule(&plan, &g_timing) < 0) {
+                g_stopRequested = 1;
+                break;
+            }
+            LOG_SIM("Rescheduled at %d keys/s, %.3f ms per loop",
+                    g_timing.rateKps, plan.loopNs / 1e6);
+        }
+
+        LOG_SIM("Loop %d/%d begin", (l+1), loops);
+        progress_schedule(&plan, l, loops, loopStart, loopDelay_ms, paused);
+        scratch_apply(dpy, &plan, 0);
+        // Queued bursts would play out after a mid-loop remap
+        int paced = atomic_load(&g_serverPaced) && backend_is_xtest();
+        if (paced && plan.chunks > 1) {
+            if (l == 0) LOG_INFO("Text rebinds scratch keys mid-loop; using client pacing");
+            paced = 0;
+        }
+        if (paced && paced_open(dpy)) {
+            p = plan_replay_paced(dpy, &plan, loopStart);
+            loopStart += p;
+            paused    += p;
+        } else {
+            p = plan_replay(dpy, &plan, loopStart);
+            loopStart += p;
+            paused    += p;
+        }
+        // The trailing flight belongs to the loop too
+        if (sim_sleep_until(loopStart + plan.loopNs)) {
+            LOG_SIM("Loop interrupted by F2 at loop %d/%d", (l+1), loops);
+            break;
+        }
+        loopStart += plan.loopNs;
+        planned   += plan.loopNs;
+
+        LOG_SIM("Loop %d/%d done", (l+1), loops);
+        if (l < loops - 1 && loopDelay_ms > 0) {
+            LOG_SIM("Sleeping %d ms before next loop...", loopDelay_ms);
+            loopStart += (int64_t)loopDelay_ms * NS_PER_MS;
+            planned   += (int64_t)loopDelay_ms * NS_PER_MS;
+            if (sim_sleep_until(loopStart)) {
+                LOG_SIM("Aborted between loops at loop %d/%d", (l+1), loops);
+                break;
+            }
+        }
+    }
+
+    plan_free(&plan);
+    message_release();
+    g_backend->sync();  // the run ends once the last edge has been handled
+    PROGRESS_SET(doneNs, g_backend->now());
+    if (g_dryRunPath) {
+        dryrun_export(g_dryRunPath);
+    } else if (g_recCount > 0) {
+        LOG_INFO("Recorded %zu key edges in memory", g_recCount);
+    }
+
+    LOG_SIM("%lu key edges sent with %lu XFlush calls so far (batch %d ms)",
+            atomic_load(&g_edgeCount), atomic_load(&g_flushCount), g_batchWindowMs);
+
+    if (!g_stopRequested) {
+        int64_t took = g_backend->now() - runStart - paused;
+        LOG_SIM("All loops completed successfully.");
+        LOG_SIM("Took %.3f ms (plus %.3f ms paused), planned %.3f ms (drift %+.3f ms)",
+                took / 1e6, paused / 1e6, planned / 1e6, (took - planned) / 1e6);
+    } else {
+        LOG_SIM("Stopped by user (F2).");
+    }
+    return g_stopRequested ? RUN_STOPPED : RUN_DONE;
+}
+
+// ---------------------------------------------------------------------
+// dump_plan: compiles `text` and writes the listing to planXtest.txt (F3)
+// ---------------------------------------------------------------------
+static void dump_plan(Display *dpy, const char *text)
+{
+    keymap_sync(dpy);
+    EventPlan plan = { .msgs = message_acquire() };
+    int rc = plan_compile(&plan, text);
+    message_release();  // the compiled plan no longer points into it
+    plan.msgs = NULL;
+    if (rc < 0 || plan_schedule(&plan, &g_timing) < 0) {
+        plan_free(&plan);
+        return;
+    }
+
+    FILE *fp = fopen("planXtest.txt", "w");
+    if (!fp) {
+        LOG_WARN("Could not open planXtest.txt for writing");
+        plan_free(&plan);
+        return;
+    }
+    fprintf(fp, "# text='%s'\n", text);
+    fprintf(fp, "# dwell=%d ms, flight=%d ms, rate=%d keys/s\n",
+            g_timing.dwellMs, g_timing.flightMs, g_timing.rateKps);
+    plan_dump(&plan, fp);
+    fclose(fp);
+
+    LOG_INFO("Plan: %d ops, %d key edges, %.3f ms per loop => planXtest.txt",
+             plan.count, plan_edge_count(&plan), plan.loopNs / 1e6);
+    plan_free(&plan);
+}
+
+// ---------------------------------------------------------------------
+// Engine thread:
+//   Owns the X connection, the keymap and everything typing-related
+//   once started, so keystroke timing never waits on the terminal.
+//   Idles in its epoll set until the UI sends a command.
+// ---------------------------------------------------------------------
+static pthread_t g_engineThread;
+static int       g_engineRunning = 0;   // UI thread only: thread exists
+
+static void *engine_main(void *arg)
+{
+    Display *dpy = arg;
+    t_logEngine = 1;  // log through g_logQueueEngine
+
+    while (!g_engineQuit) {
+        EngineMsg m;
+        while (!g_engineQuit && engine_queue_pop(&g_cmdQueue, &m)) {
+            switch (m.kind) {
+            case ENG_CMD_START:
+                g_timing        = m.timing;
+                g_batchWindowMs = m.batchMs;
+                engine_post(ENG_EV_RUNNING, m.loops);
+                engine_post_idle(simulate_typing(dpy, m.text, m.loops,
+                                                 m.startDelayMs, m.loopDelayMs));
+                break;
+            case ENG_CMD_DUMP:
+                g_timing = m.timing;
+                dump_plan(dpy, m.text);
+                engine_post_idle(RUN_DONE);  // so the UI shows its log line
+                break;
+            case ENG_CMD_QUIT:
+                g_engineQuit = 1;
+                break;
+            default:
+                // STOP/PAUSE/RATE mean nothing between runs
+                break;
+            }
+            free(m.text);
+        }
+        if (!g_engineQuit) {
+            evloop_wait(&g_engineLoop, -1);
+        }
+    }
+
+    scratch_restore(dpy);
+    paced_close();
+    return NULL;
+}
+
+static int engine_start(Display *dpy)
+{
+    g_xtestDpy = dpy;
+    if (evloop_open_engine(dpy) < 0) return -1;
+    if (pthread_create(&g_engineThread, NULL, engine_main, dpy) != 0) {
+        evloop_close(&g_engineLoop);
+        return -1;
+    }
+    g_engineRunning = 1;
+    return 0;
+}
+
+// UI => engine. Returns 0, or -1 if the queue was full.
+static int engine_send(EngineMsg *m)
+{
+    if (engine_queue_push(&g_cmdQueue, m) < 0) {
+        LOG_WARN("Engine command queue full, command dropped");
+        free(m->text);
+        return -1;
+    }
+    return 0;
+}
+
+// Ask the engine to finish (releasing held keys) and wait for it
+static void engine_stop(void)
+{
+    if (!g_engineRunning) return;
+
+    EngineMsg m = { .kind = ENG_CMD_QUIT };
+    while (engine_queue_push(&g_cmdQueue, &m) < 0) {
+        usleep(1000);
+    }
+    pthread_join(g_engineThread, NULL);
+    g_engineRunning = 0;
+    evloop_close(&g_engineLoop);
+}
+
+// ---------------------------------------------------------------------
+// decode_log_file: --decode-log FILE, binary logsXtest.bin -> text on stdout
+// ---------------------------------------------------------------------
+static int decode_log_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "ERROR: Could not open %s\n", path);
+        return 1;
+    }
+    char magic[sizeof(LOG_BIN_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+        || memcmp(magic, LOG_BIN_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "ERROR: %s is not a binary log\n", path);
+        fclose(fp);
+        return 1;
+    }
+
+    char *fmts[LOG_MAX_FORMATS] = {0};
+    char  rec[1024];
+    char  text[1024];
+    long  records = 0;
+    int   tag, bad = 0;
+
+    while (!bad && (tag = fgetc(fp)) != EOF) {
+        uint16_t id, len;
+        switch (tag) {
+        case 'S':
+            for (int i = 0; i < LOG_MAX_FORMATS; i++) {
+                free(fmts[i]);
+                fmts[i] = NULL;
+            }
+            break;
+
+        case 'F':
+            if (fread(&id, sizeof(id), 1, fp) != 1 || fread(&len, sizeof(len), 1, fp) != 1
+                || id >= LOG_MAX_FORMATS)
+            {
+                bad = 1;
+                break;
+            }
+            free(fmts[id]);
+            fmts[id] = malloc((size_t)len + 1);
+            if (!fmts[id] || fread(fmts[id], 1, len, fp) != len) {
+                bad = 1;
+                break;
+            }
+            fmts[id][len] = '\0';
+            break;
+
+        case 'R': {
+            if (fread(&len, sizeof(len), 1, fp) != 1 || len > sizeof(rec)
+                || len < sizeof(uint16_t) + sizeof(int64_t)
+                || fread(rec, 1, len, fp) != len)
+            {
+                bad = 1;
+                break;
+            }
+            int64_t ts;
+            memcpy(&id, rec, sizeof(id));
+            memcpy(&ts, rec + sizeof(id), sizeof(ts));
+            const char *args    = rec + sizeof(id) + sizeof(ts);
+            size_t      argLen  = len - sizeof(id) - sizeof(ts);
+
+            if (id == 0) {
+                snprintf(text, sizeof(text), "%.*s", (int)argLen, args);
+            } else if (id < LOG_MAX_FORMATS && fmts[id]) {
+                log_format_args(fmts[id], args, argLen, text, sizeof(text));
+            } else {
+                snprintf(text, sizeof(text), "<unknown format %u>", id);
+            }
+
+            time_t    sec = (time_t)(ts / 1000000000LL);
+            struct tm tmv;
+            char      stamp[32];
+            localtime_r(&sec, &tmv);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tmv);
+            printf("[%s.%03d] %s\n", stamp, (int)((ts / 1000000LL) % 1000), text);
+            records++;
+            break;
+        }
+
+        default:
+            bad = 1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < LOG_MAX_FORMATS; i++) free(fmts[i]);
+    fclose(fp);
+    if (bad) {
+        fprintf(stderr, "ERROR: %s is corrupt after %ld records\n", path, records);
+        return 1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------
+// UI fields: label position, colour, digits-only flag and default value.
+// Tab walks them in table order.
+// ---------------------------------------------------------------------
+typedef struct {
+    const char *label;
+    int         row, col;     // where the label starts; value follows it
+    int         color;        // COLOR_PAIR index
+    int         numeric;      // 1 => digits only
+    int         maxLen;
+    const char *defaultValue;
+    char        value[256];
+    int         pos;          // cursor == length of value
+    int         dirty;        // value needs redrawing
+    int         shownLen;     // length of the value now on screen
+} UiField;
+
+enum {
+    FIELD_TEXT,
+    FIELD_START_DELAY,
+    FIELD_LOOP_DELAY,
+    FIELD_LOOPS,
+    FIELD_RATE,
+    FIELD_DWELL,
+    FIELD_FLIGHT,
+    FIELD_BATCH,
+    FIELD_COUNT
+};
+
+static UiField g_fields[FIELD_COUNT] = {
+    { .label = "Text to type:",     .row = 1, .col =  0, .color = 2, .numeric = 0,
+      .maxLen = 255, .defaultValue = "" },
+    { .label = "Start Delay (ms):", .row = 2, .col =  0, .color = 3, .numeric = 1,
+      .maxLen =  15, .defaultValue = "3000" },
+    { .label = "Loop Delay (ms):",  .row = 3, .col =  0, .color = 4, .numeric = 1,
+      .maxLen =  15, .defaultValue = "2000" },
+    { .label = "Loops:",            .row = 4, .col =  0, .color = 5, .numeric = 1,
+      .maxLen =  15, .defaultValue = "1" },
+    { .label = "Rate (keys/s):",    .row = 2, .col = 30, .color = 3, .numeric = 1,
+      .maxLen =   5, .defaultValue = "0" },
+    { .label = "Dwell (ms):",       .row = 3, .col = 30, .color = 4, .numeric = 1,
+      .maxLen =   5, .defaultValue = "30" },
+    { .label = "Flight (ms):",      .row = 4, .col = 30, .color = 5, .numeric = 1,
+      .maxLen =   5, .defaultValue = "60" },
+    { .label = "Batch (ms):",       .row = 3, .col = 52, .color = 5, .numeric = 1,
+      .maxLen =   5, .defaultValue = "0" },
+};
+
+static int field_value_col(const UiField *f)
+{
+    return f->col + (int)strlen(f->label) + 1;
+}
+
+static void field_reset(UiField *f)
+{
+    strcpy(f->value, f->defaultValue);
+    f->pos   = (int)strlen(f->value);
+    f->dirty = 1;
+}
+
+static int field_int(int index)
+{
+    return atoi(g_fields[index].value);
+}
+
+static TypingTiming timing_from_fields(void)
+{
+    TypingTiming t;
+    t.rateKps  = field_int(FIELD_RATE);
+    t.dwellMs  = field_int(FIELD_DWELL);
+    t.flightMs = field_int(FIELD_FLIGHT);
+    return t;
+}
+
+// ---------------------------------------------------------------------
+// Screen: four windows, each rewritten only where something changed.
+//   header => row 0; panel => fields, hint and log title (rows 1-6);
+//   status => run progress (row 7); logs => everything below.
+//   wnoutrefresh + one doupdate per frame.
+// ---------------------------------------------------------------------
+#define UI_PANEL_ROW   1
+#define UI_PANEL_ROWS  6
+#define UI_STATUS_ROW  (UI_PANEL_ROW + UI_PANEL_ROWS)
+#define UI_LOGS_ROW    (UI_STATUS_ROW + 1)
+
+static WINDOW *g_winHeader = NULL;
+static WINDOW *g_winPanel  = NULL;
+static WINDOW *g_winStatus = NULL;
+static WINDOW *g_winLogs   = NULL;
+
+static int g_uiFps = 15;  // --fps: status/log redraws per second mid-run
+
+// Text last written at one spot, so an unchanged line costs nothing
+typedef struct {
+    char shown[192];
+    int  len;
+} UiText;
+
+static UiText g_uiHeader, g_uiHint, g_uiStatus, g_uiLogTitle;
+
+static void ui_text(WINDOW *win, int row, int col, UiText *t, const char *text)
+{
+    int len = (int)strlen(text);
+    if (len >= (int)sizeof(t->shown)) len = (int)sizeof(t->shown) - 1;
+    if (len == t->len && memcmp(t->shown, text, (size_t)len) == 0) return;
+
+    mvwaddnstr(win, row, col, text, len);
+    for (int i = len; i < t->len; i++) {
+        waddch(win, ' ');  // blank what the old text had beyond the new
+    }
+    memcpy(t->shown, text, (size_t)len);
+    t->shown[len] = '\0';
+    t->len = len;
+}
+
+static void ui_draw_field(int f, int active)
+{
+    UiField *uf = &g_fields[f];
+    if (!uf->dirty) return;
+
+    wattron(g_winPanel, COLOR_PAIR(uf->color) | (active ? A_REVERSE : 0));
+    mvwaddstr(g_winPanel, uf->row - UI_PANEL_ROW, field_value_col(uf), uf->value);
+    wattroff(g_winPanel, COLOR_PAIR(uf->color) | A_REVERSE);
+    for (int i = uf->pos; i < uf->shownLen; i++) {
+        waddch(g_winPanel, ' ');
+    }
+    uf->shownLen = uf->pos;
+    uf->dirty    = 0;
+}
+
+// (Re)create the windows for the current terminal size and mark
+// everything dirty; used at start-up and on KEY_RESIZE
+static void ui_layout(void)
+{
+    if (g_winHeader) delwin(g_winHeader);
+    if (g_winPanel)  delwin(g_winPanel);
+    if (g_winStatus) delwin(g_winStatus);
+    if (g_winLogs)   delwin(g_winLogs);
+
+    int logRows = LINES - UI_LOGS_ROW;
+    g_winHeader = newwin(1, COLS, 0, 0);
+    g_winPanel  = newwin(UI_PANEL_ROWS, COLS, UI_PANEL_ROW, 0);
+    g_winStatus = newwin(1, COLS, UI_STATUS_ROW, 0);
+    g_winLogs   = newwin(logRows > 1 ? logRows : 1, COLS, UI_LOGS_ROW, 0);
+    keypad(g_winPanel, TRUE);
+    leaveok(g_winHeader, TRUE);
+    leaveok(g_winStatus, TRUE);
+    leaveok(g_winLogs, TRUE);
+
+    // Labels never change; values are drawn by ui_draw_field
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        UiField *uf = &g_fields[f];
+        wattron(g_winPanel, COLOR_PAIR(uf->color));
+        mvwaddstr(g_winPanel, uf->row - UI_PANEL_ROW, uf->col, uf->label);
+        wattroff(g_winPanel, COLOR_PAIR(uf->color));
+        uf->dirty    = 1;
+        uf->shownLen = 0;
+    }
+    memset(&g_uiHeader, 0, sizeof(g_uiHeader));
+    memset(&g_uiHint, 0, sizeof(g_uiHint));
+    memset(&g_uiStatus, 0, sizeof(g_uiStatus));
+    memset(&g_uiLogTitle, 0, sizeof(g_uiLogTitle));
+    draw_logs(g_winLogs, 1);
+    clearok(curscr, TRUE);
+}
+
+// ---------------------------------------------------------------------
+// ui_draw_status: one line sampled from g_progress. `runText` is the UI's
+//   copy of the text the run was started with (token spans index it).
+// ---------------------------------------------------------------------
+static void ui_draw_status(int busy, const char *runText)
+{
+    int64_t now       = mono_ns();
+    int64_t pauseFrom = PROGRESS_GET(pauseFromNs);
+    int64_t doneAt    = PROGRESS_GET(doneNs);
+    int64_t active    = doneAt ? doneAt : pauseFrom ? pauseFrom : now;
+    int64_t typing    = active - PROGRESS_GET(typingNs) - PROGRESS_GET(pausedNs);
+    int64_t loopNs    = PROGRESS_GET(loopNs);
+    long    sent      = PROGRESS_GET(keysSent);
+
+    double cps    = typing > 0 ? sent * 1e9 / (double)typing : 0.0;
+    double target = loopNs > 0 ? PROGRESS_GET(loopKeys) * 1e9 / (double)loopNs : 0.0;
+
+    // Current token, quoted from the run's text
+    char     token[24] = "";
+    unsigned off = PROGRESS_GET(srcOff), len = PROGRESS_GET(srcLen);
+    if (len > 0 && off + len <= strlen(runText)) {
+        if (len > sizeof(token) - 1) {
+            len = sizeof(token) - 1;
+            while (len > 0 && ((unsigned char)runText[off + len] & 0xc0) == 0x80) len--;
+        }
+        for (unsigned i = 0; i < len; i++) {
+            unsigned char c = (unsigned char)runText[off + i];
+            token[i] = (isprint(c) || c >= 0x80) ? (char)c : '?';
+        }
+        token[len] = '\0';
+    }
+
+    char text[192];
+    if (!busy && PROGRESS_GET(loops) == 0) {
+        snprintf(text, sizeof(text), "Idle");
+    } else {
+        int64_t eta = busy ? PROGRESS_GET(endNs) - active : 0;
+        if (eta < 0) eta = 0;
+        int etaSec = (int)(eta / NS_PER_SEC);
+        snprintf(text, sizeof(text),
+                 "%s | loop %d/%d | keys %ld/%ld | token %s | %.1f cps (target %.1f) | ETA %d:%02d:%02d",
+                 !busy ? "Idle" : pauseFrom ? "Paused" : "Running",
+                 PROGRESS_GET(loop), PROGRESS_GET(loops), sent, PROGRESS_GET(keysTotal),
+                 token[0] ? token : "-", cps, target,
+                 etaSec / 3600, etaSec / 60 % 60, etaSec % 60);
+    }
+    wattron(g_winStatus, COLOR_PAIR(1));
+    ui_text(g_winStatus, 0, 0, &g_uiStatus, text);
+    wattroff(g_winStatus, COLOR_PAIR(1));
+}
+
+// ---------------------------------------------------------------------
+// Headless mode (--text or --script): no ncurses at all. One run goes
+// to the same engine thread, main waits for it in the UI epoll set and
+// prints a summary line. SIGINT/SIGTERM stop the run, releasing keys.
+// ---------------------------------------------------------------------
+enum {
+    EXIT_DONE      = 0,  // every loop typed
+    EXIT_SETUP     = 1,  // no X display, no engine thread, ...
+    EXIT_USAGE     = 2,
+    EXIT_COMPILE   = 3,  // the text did not compile; nothing typed
+    EXIT_STOPPED   = 4,  // a signal stopped the run early
+    EXIT_REGRESSED = 5,  // --bench: a failed check, or slower / more allocs than the baseline
+    EXIT_MISMATCH  = 6   // --harness: delivered key edges differ from the plan
+};
+
+// The whole file without its final line ending, malloc'd. NULL on error.
+static char *read_text_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    size_t len = 0, cap = 4096;
+    char  *buf = malloc(cap);
+    size_t n;
+    while (buf && (n = fread(buf + len, 1, cap - len - 1, fp)) > 0) {
+        len += n;
+        if (len == cap - 1) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) free(buf);
+            buf  = grown;
+            cap *= 2;
+        }
+    }
+    fclose(fp);
+    if (!buf) return NULL;
+
+    if (len > 0 && buf[len - 1] == '\n') len--;
+    if (len > 0 && buf[len - 1] == '\r') len--;
+    buf[len] = '\0';
+    return buf;
+}
+
+static int run_headless(EngineMsg *start)
+{
+    int loops = start->loops;
+    if (engine_send(start) < 0) return EXIT_SETUP;
+
+    int result   = -1;
+    int stopping = 0;
+    while (result < 0) {
+        evloop_wait(&g_uiLoop, -1);
+        if (atomic_load(&g_quitRequested) && !stopping) {
+            EngineMsg m = { .kind = ENG_CMD_STOP };
+            stopping = engine_send(&m) == 0;
+        }
+        EngineMsg ev;
+        while (engine_queue_pop(&g_eventQueue, &ev)) {
+            if (ev.kind == ENG_EV_IDLE) result = ev.result;
+        }
+    }
+
+    static const char *const outcome[] = { "done", "stopped", "failed" };
+    long    keys   = result == RUN_FAILED ? 0 : PROGRESS_GET(keysSent);
+    int64_t typing = PROGRESS_GET(doneNs) - PROGRESS_GET(typingNs) - PROGRESS_GET(pausedNs);
+    if (result == RUN_FAILED || typing < 0) typing = 0;
+    // A virtual clock only measures the schedule, not how long it took
+    const char *clock = g_backend->advance ? " of planned time" : "";
+    printf("xtest: %s, loop %d/%d, %ld keys in %.3f s%s (%.1f keys/s), "
+           "%lu key edges in %lu flushes\n",
+           outcome[result], result == RUN_FAILED ? 0 : PROGRESS_GET(loop), loops,
+           keys, typing / 1e9, clock, typing > 0 ? keys * 1e9 / (double)typing : 0.0,
+           atomic_load(&g_edgeCount), atomic_load(&g_flushCount));
+    fflush(stdout);
+
+    return result == RUN_DONE   ? EXIT_DONE
+         : result == RUN_FAILED ? EXIT_COMPILE : EXIT_STOPPED;
+}
+
+// Stop the engine (releasing held keys) and close everything main opened
+static void app_shutdown(Display *dpy)
+{
+    // Stops any run in progress (releasing held keys) and joins
+    engine_stop();
+
+    // Cleanup messages (the engine has let go of its snapshot)
+    message_store_close();
+
+    // Close the log file if open
+    log_writer_stop();
+    if (g_fileLog) {
+        fclose(g_fileLog);
+        g_fileLog = NULL;
+    }
+
+    if (dpy) XCloseDisplay(dpy);
+    evloop_close(&g_uiLoop);
+}
+
+// ---------------------------------------------------------------------
+// main: ncurses UI. F1 => reset fields, F2 => stop. 
+//   --text/--script run once headless instead (see run_headless).
+// ---------------------------------------------------------------------
+// ---------------------------------------------------------------------
+// Timing harness (--harness with --text/--script)
+//   Starts a private Xvfb, works out the planned edge timeline with a
+//   dry run, then types the text for real while a second client
+//   captures the delivered KeyPress/KeyRelease events through XRecord.
+//   Each delivered edge is matched to its planned one in order. The
+//   report covers the per-edge scheduling error (planned time vs.
+//   receive time, so it includes delivery latency), the hold-duration
+//   error, the inter-key jitter (key-down to key-down intervals) and the
+//   drift over the whole run. --harness-out FILE writes every edge.
+// ---------------------------------------------------------------------
+static pid_t g_xvfbPid = -1;
+
+static void xvfb_stop(void)
+{
+    if (g_xvfbPid > 0) {
+        kill(g_xvfbPid, SIGTERM);
+        waitpid(g_xvfbPid, NULL, 0);
+        g_xvfbPid = -1;
+    }
+}
+
+// Runs Xvfb on the first free display and points $DISPLAY at it
+static int xvfb_start(void)
+{
+    int fds[2];
+    if (pipe(fds) < 0) return -1;
+
+    char fdArg[16];
+    snprintf(fdArg, sizeof(fdArg), "%d", fds[1]);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // SIGTERM is blocked here for the signalfd; Xvfb must see it
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        close(fds[0]);
+        int devNull = open("/dev/null", O_RDWR);
+        if (devNull >= 0) {
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+        }
+        execlp("Xvfb", "Xvfb", "-displayfd", fdArg, "-nolisten", "tcp",
+               "-screen", "0", "640x480x24", (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    g_xvfbPid = pid;
+    atexit(xvfb_stop);
+
+    // Xvfb writes the display number once it accepts connections
+    char    buf[16];
+    size_t  got      = 0;
+    int64_t deadline = mono_ns() + 10 * NS_PER_SEC;
+    while (got < sizeof(buf) - 1 && !memchr(buf, '\n', got)) {
+        struct pollfd pfd  = { fds[0], POLLIN, 0 };
+        int64_t       left = (deadline - mono_ns()) / NS_PER_MS;
+        if (left <= 0 || poll(&pfd, 1, (int)left) <= 0) break;
+        ssize_t n = read(fds[0], buf + got, sizeof(buf) - 1 - got);
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(fds[0]);
+    buf[got] = '\0';
+
+    int display;
+    if (sscanf(buf, "%d", &display) != 1) {
+        xvfb_stop();
+        return -1;
+    }
+    char name[16];
+    snprintf(name, sizeof(name), ":%d", display);
+    setenv("DISPLAY", name, 1);
+    LOG_INFO("Started Xvfb on %s (pid %d)", name, (int)pid);
+    return 0;
+}
+
+// XRecord capture: a control connection and a data connection whose
+// replies carry the events; only the capture thread reads the latter
+static Display         *g_xrecCtrl    = NULL;
+static Display         *g_xrecData    = NULL;
+static XRecordContext   g_xrecContext = 0;
+static pthread_t        g_xrecThread;
+static atomic_int       g_xrecLive    = 0;  // XRecordStartOfData seen
+static atomic_int       g_xrecStop    = 0;
+static RecordedEdge    *g_xrecEdges   = NULL;
+static size_t           g_xrecCap     = 0;
+static atomic_ulong     g_xrecCount   = 0;
+
+static void xrec_intercept(XPointer priv, XRecordInterceptData *d)
+{
+    (void)priv;
+    if (d->category == XRecordStartOfData) {
+        atomic_store(&g_xrecLive, 1);
+    } else if (d->category == XRecordFromServer && d->data_len > 0) {
+        int64_t at   = mono_ns();
+        int     type = d->data[0] & 0x7f;
+        size_t  n    = atomic_load(&g_xrecCount);
+        if (n == g_xrecCap && (type == KeyPress || type == KeyRelease)) {
+            size_t        newCap = g_xrecCap ? g_xrecCap * 2 : 4096;
+            RecordedEdge *grown  = realloc(g_xrecEdges, newCap * sizeof(*grown));
+            if (grown) {
+                g_xrecEdges = grown;
+                g_xrecCap   = newCap;
+            }
+        }
+        if ((type == KeyPress || type == KeyRelease) && n < g_xrecCap) {
+            g_xrecEdges[n] = (RecordedEdge){ .atNs = at, .code = d->data[1],
+                                             .kind = type == KeyPress ? REC_DOWN : REC_UP };
+            atomic_store(&g_xrecCount, n + 1);
+        }
+    }
+    XRecordFreeData(d);
+}
+
+static void *xrec_main(void *arg)
+{
+    (void)arg;
+    struct pollfd pfd = { ConnectionNumber(g_xrecData), POLLIN, 0 };
+    while (!atomic_load(&g_xrecStop)) {
+        XRecordProcessReplies(g_xrecData);
+        poll(&pfd, 1, 10);
+    }
+    XRecordProcessReplies(g_xrecData);
+    return NULL;
+}
+
+static void xrec_close(void)
+{
+    if (g_xrecCtrl && g_xrecContext) XRecordFreeContext(g_xrecCtrl, g_xrecContext);
+    if (g_xrecCtrl) XCloseDisplay(g_xrecCtrl);
+    if (g_xrecData) XCloseDisplay(g_xrecData);
+    g_xrecCtrl    = NULL;
+    g_xrecData    = NULL;
+    g_xrecContext = 0;
+}
+
+static int xrec_start(void)
+{
+    int major, minor;
+    g_xrecCtrl = XOpenDisplay(NULL);
+    g_xrecData = XOpenDisplay(NULL);
+    if (!g_xrecCtrl || !g_xrecData || !XRecordQueryVersion(g_xrecCtrl, &major, &minor)) {
+        LOG_ERROR("The X server has no RECORD extension");
+        xrec_close();
+        return -1;
+    }
+
+    XRecordRange *range = XRecordAllocRange();
+    if (!range) {
+        xrec_close();
+        return -1;
+    }
+    range->device_events.first = KeyPress;
+    range->device_events.last  = KeyRelease;
+    XRecordClientSpec clients  = XRecordAllClients;
+    g_xrecContext = XRecordCreateContext(g_xrecCtrl, XRecordFromServerTime,
+                                         &clients, 1, &range, 1);
+    XFree(range);
+    XSync(g_xrecCtrl, False);
+    if (!g_xrecContext
+        || !XRecordEnableContextAsync(g_xrecData, g_xrecContext, xrec_intercept, NULL))
+    {
+        LOG_ERROR("Could not enable an XRecord context");
+        xrec_close();
+        return -1;
+    }
+    if (pthread_create(&g_xrecThread, NULL, xrec_main, NULL) != 0) {
+        xrec_close();
+        return -1;
+    }
+
+    // Nothing may be typed before the server has started recording
+    int64_t deadline = mono_ns() + 2 * NS_PER_SEC;
+    while (!atomic_load(&g_xrecLive) && mono_ns() < deadline) {
+        struct timespec ms = { 0, NS_PER_MS };
+        nanosleep(&ms, NULL);
+    }
+    if (!atomic_load(&g_xrecLive)) LOG_WARN("XRecord did not confirm the start of data");
+    return 0;
+}
+
+static void xrec_stop(void)
+{
+    XRecordDisableContext(g_xrecCtrl, g_xrecContext);
+    XSync(g_xrecCtrl, False);
+    atomic_store(&g_xrecStop, 1);
+    pthread_join(g_xrecThread, NULL);
+    xrec_close();
+}
+
+// The planned timeline: the same text, timing and loops on the dryrun
+// backend. Edges are relative to the start of the run.
+static RecordedEdge *g_harnessPlan  = NULL;
+static size_t        g_harnessCount = 0;
+
+// No Display is passed: the keymap built at startup is used as is, and
+// scratch bindings only change the dryrun backend's model, so planning
+// never talks to the server.
+static int harness_plan(const EngineMsg *run, const char *text)
+{
+    const KeyBackend *real = g_backend;
+    backend_select("dryrun");
+    g_timing        = run->timing;
+    g_batchWindowMs = run->batchMs;
+    int result = simulate_typing(NULL, text, run->loops, run->startDelayMs, run->loopDelayMs);
+    g_backend = real;
+    if (result != RUN_DONE) return result;
+
+    g_harnessPlan = malloc((g_recCount ? g_recCount : 1) * sizeof(*g_harnessPlan));
+    if (!g_harnessPlan) return RUN_FAILED;
+    g_harnessCount = 0;
+    for (size_t i = 0; i < g_recCount; i++) {
+        if (g_recEdges[i].kind == REC_BIND) continue;  // XRecord only sees key events
+        g_harnessPlan[g_harnessCount]       = g_recEdges[i];
+        g_harnessPlan[g_harnessCount].atNs -= g_recStartNs;
+        g_harnessCount++;
+    }
+    record_clear();
+    g_edgeCount  = 0;  // the summary line is about the real run
+    g_flushCount = 0;
+    return RUN_DONE;
+}
+
+static int harness_cmp_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentile `p` of `n` sorted errors, in ms
+static double harness_pct(const int64_t *sorted, size_t n, size_t p)
+{
+    return (double)sorted[(n * p + 99) / 100 - 1] / 1e6;
+}
+
+// One report line: signed mean, then percentiles of the absolute error
+static void harness_stats(const char *label, int64_t *err, size_t n)
+{
+    if (n == 0) {
+        printf("  %-17s (no samples)\n", label);
+        return;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum   += (double)err[i];
+        err[i] = err[i] < 0 ? -err[i] : err[i];
+    }
+    qsort(err, n, sizeof(*err), harness_cmp_ns);
+    printf("  %-17s mean %+8.3f ms  |err| p50 %7.3f  p90 %7.3f  p99 %7.3f  max %7.3f ms  (%zu)\n",
+           label, sum / (double)n / 1e6, harness_pct(err, n, 50), harness_pct(err, n, 90),
+           harness_pct(err, n, 99), err[n - 1] / 1e6, n);
+}
+
+static int harness_report(int64_t runStart, const char *outPath)
+{
+    size_t        seen  = atomic_load(&g_xrecCount);
+    size_t        n     = seen < g_harnessCount ? seen : g_harnessCount;
+    RecordedEdge *plan  = g_harnessPlan;
+    RecordedEdge *got   = g_xrecEdges;
+    size_t        wrong = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (plan[i].code != got[i].code || plan[i].kind != got[i].kind) wrong++;
+    }
+    printf("harness: %zu key edges planned, %zu delivered, %zu out of order\n",
+           g_harnessCount, seen, wrong);
 
+    FILE *fp = outPath ? fopen(outPath, "w") : NULL;
+    if (outPath && !fp) LOG_ERROR("Could not open %s for writing", outPath);
+    if (fp) fputs("planned_ms,actual_ms,error_ms,keycode,edge\n", fp);
 
-// ---------------------------------------------------------------------
-// add_log
-//   Writes to our ring-buffer logs *and* appends to logsXtest.txt
-// ---------------------------------------------------------------------
-static void add_log(const char *fmt, ...)
-{
-    // 1) Build the new log string in a temporary buffer
-    char tmp[512];
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(tmp, sizeof(tmp), fmt, args);
-    va_end(args);
+    int64_t *sched  = calloc(n + 1, sizeof(int64_t));
+    int64_t *hold   = calloc(n + 1, sizeof(int64_t));
+    int64_t *jitter = calloc(n + 1, sizeof(int64_t));
+    size_t   holds  = 0, gaps = 0, lastDown = SIZE_MAX;
+    size_t   downAt[256];
+    for (int c = 0; c < 256; c++) downAt[c] = SIZE_MAX;
 
-    // 2) Store in ring buffer
-    strncpy(g_logBuffer[g_logHead], tmp, sizeof(g_logBuffer[g_logHead]) - 1);
-    g_logBuffer[g_logHead][sizeof(g_logBuffer[g_logHead]) - 1] = '\0';
-    g_logHead = (g_logHead + 1) % MAX_LOG_LINES;
+    for (size_t i = 0; sched && hold && jitter && i < n; i++) {
+        int64_t planned = runStart + plan[i].atNs;
+        sched[i] = got[i].atNs - planned;
+        if (fp) {
+            fprintf(fp, "%.6f,%.6f,%.6f,%u,%s\n", plan[i].atNs / 1e6,
+                    (got[i].atNs - runStart) / 1e6, sched[i] / 1e6,
+                    got[i].code, got[i].kind == REC_DOWN ? "down" : "up");
+        }
+        if (got[i].kind == REC_DOWN) {
+            if (lastDown != SIZE_MAX) {
+                jitter[gaps++] = (got[i].atNs - got[lastDown].atNs)
+                               - (plan[i].atNs - plan[lastDown].atNs);
+            }
+            lastDown             = i;
+            downAt[got[i].code]  = i;
+        } else if (downAt[got[i].code] != SIZE_MAX) {
+            size_t d = downAt[got[i].code];
+            hold[holds++] = (got[i].atNs - got[d].atNs) - (plan[i].atNs - plan[d].atNs);
+            downAt[got[i].code] = SIZE_MAX;
+        }
+    }
+    if (fp) fclose(fp);
 
-    // 3) Also append to logsXtest.txt (if open)
-    if (g_fileLog) {
-        fprintf(g_fileLog, "%s\n", tmp);
-        fflush(g_fileLog);
+    if (sched && hold && jitter) {
+        harness_stats("schedule error", sched, n);
+        harness_stats("hold error", hold, holds);
+        harness_stats("inter-key jitter", jitter, gaps);
+    }
+    if (n > 1) {
+        int64_t actual  = got[n - 1].atNs - got[0].atNs;
+        int64_t planned = plan[n - 1].atNs - plan[0].atNs;
+        printf("  %-17s %+.3f ms over %.3f s (%+.1f ppm)\n", "run drift",
+               (actual - planned) / 1e6, planned / 1e9,
+               planned > 0 ? (actual - planned) * 1e6 / (double)planned : 0.0);
     }
+    fflush(stdout);
+    free(sched);
+    free(hold);
+    free(jitter);
+
+    return (seen != g_harnessCount || wrong) ? EXIT_MISMATCH : EXIT_DONE;
 }
 
-static void draw_logs(int start_line)
+// Types the text for real with the capture running, then reports
+static int harness_run(EngineMsg *run, const char *outPath)
 {
-    int max_y, max_x;
-    getmaxyx(stdscr, max_y, max_x);
+    int startDelayMs = run->startDelayMs;
+    if (xrec_start() < 0) return EXIT_SETUP;
+
+    int rc = run_headless(run);
 
-    int lines_for_logs = max_y - start_line;
-    if (lines_for_logs <= 0) return;
+    // The engine syncs after the last edge; the capture lags a little
+    int64_t deadline = mono_ns() + NS_PER_SEC;
+    while (atomic_load(&g_xrecCount) < g_harnessCount && mono_ns() < deadline) {
+        struct timespec ms = { 0, NS_PER_MS };
+        nanosleep(&ms, NULL);
+    }
+    xrec_stop();
 
-    int index = g_logHead;
-    for (int i = 0; i < lines_for_logs; i++) {
-        index = (index - 1 + MAX_LOG_LINES) % MAX_LOG_LINES;
-        mvprintw(max_y - 1 - i, 0, "%s", g_logBuffer[index]);
+    if (rc == EXIT_DONE) {
+        int64_t runStart = PROGRESS_GET(typingNs) - (int64_t)startDelayMs * NS_PER_MS;
+        rc = harness_report(runStart, outPath);
     }
+    free(g_harnessPlan);
+    free(g_xrecEdges);
+    return rc;
 }
 
+#ifdef XTEST_BENCH
 // ---------------------------------------------------------------------
-// Press/Release Keys
+// Benchmarks (-DXTEST_BENCH, then --bench)
+//   Times the hot paths in-process and reports ns/op and allocations/op.
+//   Each case is scaled until one sample takes at least BENCH_MIN_NS
+//   (100 ms), and the best of BENCH_SAMPLES (7) samples is kept.
+//   --bench-save FILE writes the results as "name ns allocs" lines.
+//   --bench-compare FILE reads such a file and exits with EXIT_REGRESSED
+//   if a case allocates more, or got both more than --bench-tolerance
+//   percent (10 by default) and more than --bench-floor ns (5 by
+//   default) slower; at a few ns/op, noise alone exceeds 10%. A case
+//   that fails its own check (log/fallback) prints FAILED and exits the
+//   same way; build with -fsanitize=address to have it catch overflows
+//   too.
 // ---------------------------------------------------------------------
-static void pressKeyDown(Display *dpy, KeySym ks)
+// Every allocation in the process, whichever thread makes it
+static atomic_ulong g_benchAllocs = 0;
+
+#ifndef __SANITIZE_ADDRESS__  // ASan owns malloc; allocs/op reads 0 there
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
 {
-    KeyCode kc = XKeysymToKeycode(dpy, ks);
-    if (!kc) {
-        add_log("WARN: XKeysymToKeycode failed for KeySym=0x%lx (DOWN)", (unsigned long)ks);
-        return;
-    }
-    XTestFakeKeyEvent(dpy, kc, True, CurrentTime);
-    XFlush(dpy);
+    atomic_fetch_add_explicit(&g_benchAllocs, 1, memory_order_relaxed);
+    return __libc_malloc(size);
 }
 
-static void pressKeyUp(Display *dpy, KeySym ks)
+void *calloc(size_t count, size_t size)
 {
-    KeyCode kc = XKeysymToKeycode(dpy, ks);
-    if (!kc) {
-        add_log("WARN: XKeysymToKeycode failed for KeySym=0x%lx (UP)", (unsigned long)ks);
-        return;
-    }
-    XTestFakeKeyEvent(dpy, kc, False, CurrentTime);
-    XFlush(dpy);
+    atomic_fetch_add_explicit(&g_benchAllocs, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
 }
 
-// Quick press+release
-static void pressKey(Display *dpy, KeySym ks)
+void *realloc(void *ptr, size_t size)
 {
-    pressKeyDown(dpy, ks);
-    usleep(30000);
-    pressKeyUp(dpy, ks);
-    usleep(30000);
+    atomic_fetch_add_explicit(&g_benchAllocs, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
 }
+#endif
 
-// ---------------------------------------------------------------------
-// map_char_to_keysym: single normal character -> KeySym
-// ---------------------------------------------------------------------
-static KeySym map_char_to_keysym(char c)
-{
-    switch(c)
-    {
-        case ' ':  return XK_space;
-        case '!':  return XK_exclam;
-        case '"':  return XK_quotedbl;
-        case '#':  return XK_numbersign;
-        case '$':  return XK_dollar;
-        case '%':  return XK_percent;
-        case '&':  return XK_ampersand;
-        case '\'': return XK_apostrophe;
-        case '(':  return XK_parenleft;
-        case ')':  return XK_parenright;
-        case '*':  return XK_asterisk;
-        case '+':  return XK_plus;
-        case ',':  return XK_comma;
-        case '-':  return XK_minus;
-        case '.':  return XK_period;
-        case '/':  return XK_slash;
-        case ':':  return XK_colon;
-        case ';':  return XK_semicolon;
-        case '<':  return XK_less;
-        case '=':  return XK_equal;
-        case '>':  return XK_greater;
-        case '?':  return XK_question;
-        case '@':  return XK_at;
-        case '[':  return XK_bracketleft;
-        case '\\': return XK_backslash;
-        case ']':  return XK_bracketright;
-        case '^':  return XK_asciicircum;
-        case '_':  return XK_underscore;
-        case '`':  return XK_grave;
-        case '{':  return XK_braceleft;
-        case '|':  return XK_bar;
-        case '}':  return XK_braceright;
-        case '~':  return XK_asciitilde;
+#define BENCH_TEXT_SIZE 4096
+#define BENCH_MIN_NS    (100 * NS_PER_MS)
+#define BENCH_SAMPLES   7
 
-        // newline -> Return
-        case '\n':
-        case '\r':
-            return XK_Return;
-    }
+static char g_benchPlain[BENCH_TEXT_SIZE];
+static char g_benchTokens[BENCH_TEXT_SIZE];
+static char g_benchHostile[BENCH_TEXT_SIZE];
 
-    // Letters, digits, etc.
-    char buf[2] = { c, 0 };
-    KeySym ks = XStringToKeysym(buf);
-    if (ks == NoSymbol) {
-        return NoSymbol;
+// Repeat `unit` to fill `buf` (NUL-terminated)
+static void bench_fill(char *buf, const char *unit)
+{
+    size_t len = strlen(unit), n = 0;
+    while (n + 1 < BENCH_TEXT_SIZE) {
+        buf[n] = unit[n % len];
+        n++;
     }
-    return ks;
+    buf[n] = '\0';
 }
 
-// Quick send of a single normal character
-static void send_char(Display *dpy, char c)
+// One compile-style scan of `text`: every call is one op
+static uint64_t bench_scan(const char *text)
 {
-    KeySym ks = map_char_to_keysym(c);
-    if (ks == NoSymbol) {
-        add_log("WARN: No KeySym for '%c' (ASCII %d)", c, (int)c);
-        return;
+    size_t   len = strlen(text);
+    uint64_t ops = 0;
+    for (size_t i = 0; i < len; ) {
+        TokenAction action;
+        int consumed = parse_special_token(NULL, &text[i], len - i, &action);
+        i += consumed > 0 ? (size_t)consumed : 1;
+        ops++;
     }
-    pressKey(dpy, ks);
+    return ops;
 }
 
-// ---------------------------------------------------------------------
-// Loading messages.txt so {messageN} can expand
-// ---------------------------------------------------------------------
-static void load_messages_file(const char *filename)
+static uint64_t bench_parse_plain(uint64_t reps)
 {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        add_log("INFO: Could not open %s, so {messageN} won't work", filename);
-        return;
-    }
-
-    char linebuf[1024];
-    int index = 0;
-    while (fgets(linebuf, sizeof(linebuf), fp)) {
-        // strip newline
-        size_t len = strlen(linebuf);
-        while (len > 0 && (linebuf[len-1] == '\n' || linebuf[len-1] == '\r')) {
-            linebuf[len-1] = '\0';
-            len--;
-        }
-        g_messages[index] = strdup(linebuf);
-        index++;
-        if (index >= MAX_MESSAGES) break;
-    }
-    g_messageCount = index;
-    fclose(fp);
-    add_log("INFO: Loaded %d lines from %s for {messageN}", g_messageCount, filename);
+    uint64_t ops = 0;
+    for (uint64_t r = 0; r < reps; r++) ops += bench_scan(g_benchPlain);
+    return ops;
 }
 
-// ---------------------------------------------------------------------
-// TokenAction: either a single KeySym press/hold or an "expanded text"
-// ---------------------------------------------------------------------
-typedef struct {
-    KeySym sym;           // 0 if not relevant
-    int holdMs;           // 0 if quick press
-    char expandBuf[2048]; // if we want to expand text (e.g. from messages.txt)
-    int useExpand;        // 1 if expandBuf is valid
-} TokenAction;
+static uint64_t bench_parse_tokens(uint64_t reps)
+{
+    uint64_t ops = 0;
+    for (uint64_t r = 0; r < reps; r++) ops += bench_scan(g_benchTokens);
+    return ops;
+}
 
-// ---------------------------------------------------------------------
-// parse_special_token: checks if the text at position i is one of:
-//   - {up}, {down}, {left}, {right}, {enter}, {shift}, {ctrl}, {alt}, {space}
-//   - each can have :NNN hold time, e.g. {up:3000}, {space:1500}
-//   - {messageN} => load line #N from messages.txt
-// If recognized, returns the length of that token in the string. If not, 0.
-// ---------------------------------------------------------------------
-static int parse_special_token(const char *text, TokenAction *out)
+static uint64_t bench_parse_hostile(uint64_t reps)
 {
-    if (text[0] != '{') return 0;
+    uint64_t ops = 0;
+    for (uint64_t r = 0; r < reps; r++) ops += bench_scan(g_benchHostile);
+    return ops;
+}
 
-    // 1) Check if it's {messageN}
-    if (strncmp(text, "{message", 8) == 0) {
-        int idx = 8;
-        char numBuf[32];
-        int nb = 0;
-        while (text[idx] >= '0' && text[idx] <= '9' && nb < (int)sizeof(numBuf)-1) {
-            numBuf[nb++] = text[idx++];
-        }
-        numBuf[nb] = '\0';
-
-        if (text[idx] == '}') {
-            // parse the N
-            int msgIndex = atoi(numBuf);
-            if (msgIndex < 1 || msgIndex > g_messageCount) {
-                add_log("WARN: {message%d} out of range (1..%d)", msgIndex, g_messageCount);
-                return 0;
-            }
-            // valid line
-            out->sym       = 0;
-            out->holdMs    = 0;
-            out->useExpand = 1;
-            strncpy(out->expandBuf, g_messages[msgIndex-1], sizeof(out->expandBuf)-1);
-            out->expandBuf[sizeof(out->expandBuf)-1] = '\0';
+static uint64_t bench_char_keysym(uint64_t reps)
+{
+    volatile KeySym sink = 0;
+    for (uint64_t r = 0; r < reps; r++) {
+        for (int c = 0; c < 256; c++) sink = map_char_to_keysym((char)c);
+    }
+    (void)sink;
+    return reps * 256;
+}
 
-            add_log("SIM: Found token {message%s} => line %d: \"%s\"",
-                    numBuf, msgIndex, out->expandBuf);
-            return idx + 1; // skip '}'
-        }
-        return 0;
+static uint64_t bench_log(uint64_t reps, int binary)
+{
+    g_logBinary = binary;
+    for (uint64_t r = 0; r < reps; r++) {
+        LOG_INFO("Loop %d/%d begin, %ld keys, text='%s'", (int)r, 100, (long)r * 7, "hello");
     }
+    g_logBinary = 0;
+    return reps;
+}
 
-    // 2) If not {messageN}, check for up/down/left/right/enter/shift/ctrl/alt/space
-    struct {
-        const char *cmd;
-        KeySym sym;
-    } table[] = {
-        {"up",    XK_Up},
-        {"down",  XK_Down},
-        {"left",  XK_Left},
-        {"right", XK_Right},
-        {"enter", XK_Return},
-        {"shift", XK_Shift_L},
-        {"ctrl",  XK_Control_L},
-        {"alt",   XK_Alt_L},
-        {"space", XK_space}, // new
-        {NULL,    0}
-    };
+static uint64_t bench_log_text(uint64_t reps)   { return bench_log(reps, 0); }
+static uint64_t bench_log_binary(uint64_t reps) { return bench_log(reps, 1); }
 
-    for (int i = 0; table[i].cmd != NULL; i++) {
-        const char *cmd   = table[i].cmd;
-        size_t      c_len = strlen(cmd);
-
-        if (strncmp(&text[1], cmd, c_len) == 0) {
-            int idx_after = 1 + (int)c_len; // after "up" in "{up"
-
-            if (text[idx_after] == '}') {
-                // quick press
-                out->sym       = table[i].sym;
-                out->holdMs    = 0;
-                out->useExpand = 0;
-                return idx_after + 1; 
-            }
-            else if (text[idx_after] == ':') {
-                // parse hold time
-                int digits_start = idx_after + 1;
-                char holdBuf[32];
-                int hb = 0;
-                while (text[digits_start] >= '0' && text[digits_start] <= '9'
-                       && hb < (int)sizeof(holdBuf)-1)
-                {
-                    holdBuf[hb++] = text[digits_start++];
-                }
-                holdBuf[hb] = '\0';
+// A binary-log line that can't be deferred (%a) and fills LOG_LINE_MAX:
+// the longest text fallback record, through the queue and the drain.
+// Doubles as a check: 0 ops if any record lost bytes on the way.
+static uint64_t bench_log_fallback(uint64_t reps)
+{
+    static char wide[LOG_LINE_MAX + 100];
+    memset(wide, 'A', sizeof(wide) - 1);
 
-                if (text[digits_start] == '}') {
-                    out->sym       = table[i].sym;
-                    out->holdMs    = atoi(holdBuf);
-                    out->useExpand = 0;
-                    return digits_start + 1; 
-                }
-                else {
-                    return 0;
-                }
-            }
-            else {
-                return 0;
-            }
-        }
+    FILE *fp = tmpfile();
+    if (!fp) return 0;
+    g_logBinary        = 1;
+    g_logThreadRunning = 1;  // queue records; drained here, not by a thread
+    for (uint64_t r = 0; r < reps; r++) {
+        LOG_INFO("%a %s", 1.0, wide);
+        if ((r & 255) == 255) log_queue_drain(fp);
     }
+    log_queue_drain(fp);
+    g_logThreadRunning = 0;
+    g_logBinary        = 0;
 
-    return 0;
+    long   got  = ftell(fp);
+    size_t each = 1 + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(int64_t) + (LOG_LINE_MAX - 1);
+    fclose(fp);
+    return got == (long)(reps * each) ? reps : 0;
 }
 
-// Forward declaration
-static void parse_and_type(Display *dpy, const char *text);
-
-// Expand a chunk (like from {messageN}) recursively
-static void expand_and_parse(Display *dpy, const char *chunk)
+// Below the threshold: the macro's level check and nothing else
+static uint64_t bench_log_filtered(uint64_t reps)
 {
-    parse_and_type(dpy, chunk);
+    for (uint64_t r = 0; r < reps; r++) {
+        TRACE_SIM("Sending char '%c'", (int)(r & 0x7f));
+    }
+    return reps;
 }
 
-// ---------------------------------------------------------------------
-// parse_and_type:
-//   Goes through `text`, typing normal chars or handling tokens.
-//   We do a small "poll" for F2 after each character/token so
-//   the user can press F2 to stop mid-run. 
-// ---------------------------------------------------------------------
-static void parse_and_type(Display *dpy, const char *text)
+// Compile, schedule and replay through the null backend: one op per edge
+static uint64_t bench_end_to_end(uint64_t reps)
 {
-    int i = 0;
-
-    // Make getch() non-blocking so we can see if user pressed F2 mid-typing
-    nodelay(stdscr, TRUE);
-
-    while (text[i] && !g_stopRequested) {
-        // Check if user pressed F2 or F1
-        int ch = getch();
-        while (ch != ERR) {
-            if (ch == KEY_F(2)) {
-                add_log("F2 pressed => STOP requested");
-                g_stopRequested = 1;
-            }
-            else if (ch == KEY_F(1)) {
-                add_log("F1 pressed => resetting fields (in parse_and_type)");
-            }
-            ch = getch();
+    static const TypingTiming fast = { 0, 0, 0 };
+    uint64_t edges = g_edgeCount;
+    for (uint64_t r = 0; r < reps; r++) {
+        EventPlan plan = {0};
+        if (plan_compile(&plan, g_benchTokens) == 0 && plan_schedule(&plan, &fast) == 0) {
+            plan_replay(NULL, &plan, 0);  // every deadline is long past
         }
+        plan_free(&plan);
+    }
+    return g_edgeCount - edges;
+}
 
-        if (g_stopRequested) break;
+typedef struct {
+    const char *name;
+    uint64_t  (*run)(uint64_t reps);  // returns the number of ops done
+    double      ns;                   // results, best sample
+    double      allocs;
+} BenchCase;
 
-        // Try to parse a special token
-        TokenAction action;
-        memset(&action, 0, sizeof(action));
+static BenchCase g_benchCases[] = {
+    { "parse/plain",     bench_parse_plain,   0, 0 },
+    { "parse/tokens",    bench_parse_tokens,  0, 0 },
+    { "parse/hostile",   bench_parse_hostile, 0, 0 },
+    { "char_keysym",     bench_char_keysym,   0, 0 },
+    { "log/text",        bench_log_text,      0, 0 },
+    { "log/binary",      bench_log_binary,    0, 0 },
+    { "log/fallback",    bench_log_fallback,  0, 0 },
+    { "log/filtered",    bench_log_filtered,  0, 0 },
+    { "e2e/null_edges",  bench_end_to_end,    0, 0 },
+};
+#define BENCH_COUNT ((int)(sizeof(g_benchCases) / sizeof(g_benchCases[0])))
 
-        int consumed = parse_special_token(&text[i], &action);
-        if (consumed > 0) {
-            if (action.useExpand) {
-                // {messageN} => expand text
-                add_log("SIM: Insert line => \"%s\"", action.expandBuf);
-                expand_and_parse(dpy, action.expandBuf);
-            }
-            else {
-                // a single key press or hold
-                if (action.holdMs > 0) {
-                    add_log("SIM: Holding KeySym=0x%lx for %d ms", 
-                            (unsigned long)action.sym, action.holdMs);
-                    pressKeyDown(dpy, action.sym);
-
-                    // Sleep in small increments, so we can see if user hits F2
-                    int remain = action.holdMs;
-                    const int step = 50; // check every 50 ms
-                    while (remain > 0 && !g_stopRequested) {
-                        usleep(step * 1000);
-                        remain -= step;
-
-                        // Poll again for F2
-                        int c2 = getch();
-                        while (c2 != ERR) {
-                            if (c2 == KEY_F(2)) {
-                                add_log("F2 pressed => STOP");
-                                g_stopRequested = 1;
-                            }
-                            else if (c2 == KEY_F(1)) {
-                                add_log("F1 pressed => resetting fields (mid hold)");
-                            }
-                            c2 = getch();
-                        }
-                        if (g_stopRequested) break;
-                    }
+static void bench_measure(BenchCase *bc)
+{
+    uint64_t reps = 1;
+    for (;;) {
+        int64_t from = mono_ns();
+        if (bc->run(reps) == 0) {
+            bc->ns = -1;  // the case's own check failed
+            return;
+        }
+        if (mono_ns() - from >= BENCH_MIN_NS || reps >= (1ull << 40)) break;
+        reps *= 2;
+    }
+    bc->ns = -1;
+    for (int s = 0; s < BENCH_SAMPLES; s++) {
+        unsigned long allocs = atomic_load(&g_benchAllocs);
+        int64_t       from   = mono_ns();
+        uint64_t      ops    = bc->run(reps);
+        int64_t       took   = mono_ns() - from;
+        if (ops == 0) ops = 1;
+        double ns = (double)took / (double)ops;
+        if (bc->ns < 0 || ns < bc->ns) {
+            bc->ns     = ns;
+            bc->allocs = (double)(atomic_load(&g_benchAllocs) - allocs) / (double)ops;
+        }
+    }
+}
 
-                    // done holding
-                    pressKeyUp(dpy, action.sym);
-                    usleep(30000);
-                } else {
-                    add_log("SIM: Quick press KeySym=0x%lx", (unsigned long)action.sym);
-                    pressKey(dpy, action.sym);
-                }
-            }
-            i += consumed;
-        } else {
-            // normal single char
-            add_log("SIM: Sending char '%c'", text[i]);
-            send_char(dpy, text[i]);
-            i++;
+// Baseline file: "name ns allocs" per line, '#' comments
+static int bench_load(const char *path, double *ns, double *allocs)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    for (int b = 0; b < BENCH_COUNT; b++) ns[b] = -1;
 
-            // small sleep so the keystrokes aren't instant
-            // also to allow user time to press F2
-            usleep(30000);
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char   name[64];
+        double n, a;
+        if (line[0] == '#' || sscanf(line, "%63s %lf %lf", name, &n, &a) != 3) continue;
+        for (int b = 0; b < BENCH_COUNT; b++) {
+            if (strcmp(name, g_benchCases[b].name) == 0) {
+                ns[b]     = n;
+                allocs[b] = a;
+            }
         }
     }
-
-    // Restore blocking getch() in case we continue in the UI
-    nodelay(stdscr, FALSE);
+    fclose(fp);
+    return 0;
 }
 
-// ---------------------------------------------------------------------
-// simulate_typing: does multiple loops, with start & loop delays
-// ---------------------------------------------------------------------
-static void simulate_typing(Display *dpy, const char *text, 
-                            int loops, int startDelay_ms, int loopDelay_ms)
+static int bench_main(const char *savePath, const char *comparePath, double tolerancePct,
+                      double floorNs)
 {
-    add_log("SIM: StartDelay=%d, LoopDelay=%d, Loops=%d, text='%s'",
-            startDelay_ms, loopDelay_ms, loops, text);
+    double baseNs[BENCH_COUNT], baseAllocs[BENCH_COUNT];
+    if (comparePath && bench_load(comparePath, baseNs, baseAllocs) < 0) {
+        fprintf(stderr, "ERROR: Could not read baseline %s\n", comparePath);
+        return EXIT_USAGE;
+    }
 
-    g_stopRequested = 0; // reset before we begin
+    // Nothing on screen, no log file: add_log only fills the ring buffer
+    atomic_store(&g_logLevel, LOG_LVL_INFO);
+    keymap_build_builtin();
+    backend_select("null");
+    bench_fill(g_benchPlain, "The quick brown fox jumps over the lazy dog. ");
+    bench_fill(g_benchTokens, "ab{enter}{up:20}c{tab}{F5}{keysym:KP_Enter}{shift}d ");
+    bench_fill(g_benchHostile, "{{{message12{keysym:{up:99999999999{aaaaaaaaaaaaaaaaaa{:{}");
 
-    // initial delay
-    if (startDelay_ms > 0) {
-        add_log("SIM: Sleeping %d ms before typing...", startDelay_ms);
-        int remain = startDelay_ms;
-        const int step = 50; 
-        nodelay(stdscr, TRUE);
-
-        while (remain > 0 && !g_stopRequested) {
-            usleep(step * 1000);
-            remain -= step;
-
-            // Check for F2
-            int c = getch();
-            while (c != ERR) {
-                if (c == KEY_F(2)) {
-                    add_log("F2 pressed => STOP requested (before we start typing)");
-                    g_stopRequested = 1;
-                } else if (c == KEY_F(1)) {
-                    add_log("F1 pressed => resetting fields (pre-typing)");
-                }
-                c = getch();
-            }
+    int regressed = 0;
+    printf("%-16s %12s %10s", "benchmark", "ns/op", "allocs/op");
+    if (comparePath) printf(" %12s %8s", "baseline", "delta");
+    printf("\n");
+    for (int b = 0; b < BENCH_COUNT; b++) {
+        BenchCase *bc = &g_benchCases[b];
+        bench_measure(bc);
+        if (bc->ns < 0) {
+            printf("%-16s %12s\n", bc->name, "FAILED");
+            regressed = 1;
+            continue;
         }
-        nodelay(stdscr, FALSE);
-
-        if (g_stopRequested) {
-            add_log("SIM: Aborted before typing began.");
-            return;
+        printf("%-16s %12.2f %10.3f", bc->name, bc->ns, bc->allocs);
+        if (comparePath && baseNs[b] >= 0) {
+            double delta = baseNs[b] > 0 ? (bc->ns - baseNs[b]) * 100.0 / baseNs[b] : 0.0;
+            int    worse = (delta > tolerancePct && bc->ns - baseNs[b] > floorNs)
+                        || bc->allocs > baseAllocs[b] + 0.001;
+            printf(" %12.2f %+7.1f%%%s", baseNs[b], delta, worse ? "  REGRESSED" : "");
+            regressed |= worse;
+        } else if (comparePath) {
+            printf(" %12s", "(new)");
         }
+        printf("\n");
+        fflush(stdout);
     }
 
-    for (int l = 0; l < loops; l++) {
-        if (g_stopRequested) break;
-
-        add_log("SIM: Loop %d/%d begin", (l+1), loops);
-        parse_and_type(dpy, text);
-        if (g_stopRequested) {
-            add_log("SIM: Loop interrupted by F2 at loop %d/%d", (l+1), loops);
-            break;
+    if (savePath) {
+        FILE *fp = fopen(savePath, "w");
+        if (!fp) {
+            fprintf(stderr, "ERROR: Could not open %s for writing\n", savePath);
+            return EXIT_SETUP;
         }
+        fprintf(fp, "# xtest_simulator --bench: name ns/op allocs/op\n");
+        for (int b = 0; b < BENCH_COUNT; b++) {
+            fprintf(fp, "%s %.3f %.4f\n", g_benchCases[b].name,
+                    g_benchCases[b].ns, g_benchCases[b].allocs);
+        }
+        fclose(fp);
+    }
+    return regressed ? EXIT_REGRESSED : EXIT_DONE;
+}
+#endif // XTEST_BENCH
 
-        add_log("SIM: Loop %d/%d done", (l+1), loops);
-        if (l < loops - 1 && loopDelay_ms > 0) {
-            add_log("SIM: Sleeping %d ms before next loop...", loopDelay_ms);
-
-            int remain = loopDelay_ms;
-            const int step = 50;
-            nodelay(stdscr, TRUE);
-
-            while (remain > 0 && !g_stopRequested) {
-                usleep(step * 1000);
-                remain -= step;
-
-                int c = getch();
-                while (c != ERR) {
-                    if (c == KEY_F(2)) {
-                        add_log("F2 pressed => STOP requested (between loops)");
-                        g_stopRequested = 1;
-                    } else if (c == KEY_F(1)) {
-                        add_log("F1 pressed => resetting fields (between loops)");
-                    }
-                    c = getch();
-                }
-            }
-            nodelay(stdscr, FALSE);
+int main(int argc, char **argv)
+{
+    // Headless run: text, loops, delays and timing from the command line
+    char        *headlessText = NULL;
+    int          headlessOpts = 0;  // run options seen (need --text/--script)
+    int          levelSet     = 0;
+    EngineMsg    run          = { .kind = ENG_CMD_START, .loops = 1, .timing = g_timing };
+    int          harness      = 0;  // --harness: measure the run on a private Xvfb
+    const char  *harnessOut   = NULL;
+#ifdef XTEST_BENCH
+    int          bench          = 0;
+    const char  *benchSave      = NULL;
+    const char  *benchCompare   = NULL;
+    double       benchTolerance = 10.0;
+    double       benchFloor     = 5.0;  // ns/op
+#endif
 
-            if (g_stopRequested) {
-                add_log("SIM: Aborted between loops at loop %d/%d", (l+1), loops);
-                break;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--log-commit-ms") == 0 && a + 1 < argc) {
+            g_logCommitMs = atoi(argv[++a]);
+            if (g_logCommitMs < 1) g_logCommitMs = 1;
+        } else if (strcmp(argv[a], "--log-level") == 0 && a + 1 < argc) {
+            int level = log_level_from_name(argv[++a]);
+            if (level < 0) {
+                fprintf(stderr, "ERROR: Unknown log level '%s' (SIM, DEBUG, INFO, WARN, ERROR)\n",
+                        argv[a]);
+                return EXIT_USAGE;
+            }
+            atomic_store(&g_logLevel, level);
+            levelSet = 1;
+        } else if (strcmp(argv[a], "--text") == 0 && a + 1 < argc) {
+            free(headlessText);
+            headlessText = strdup(argv[++a]);
+        } else if (strcmp(argv[a], "--script") == 0 && a + 1 < argc) {
+            free(headlessText);
+            headlessText = read_text_file(argv[++a]);
+            if (!headlessText) {
+                fprintf(stderr, "ERROR: Could not read %s\n", argv[a]);
+                return EXIT_USAGE;
             }
+        } else if (strcmp(argv[a], "--loops") == 0 && a + 1 < argc) {
+            run.loops = atoi(argv[++a]);
+            if (run.loops < 1) run.loops = 1;
+            headlessOpts = 1;
+        } else if (strcmp(argv[a], "--start-delay") == 0 && a + 1 < argc) {
+            run.startDelayMs = atoi(argv[++a]);
+            if (run.startDelayMs < 0) run.startDelayMs = 0;
+            headlessOpts = 1;
+        } else if (strcmp(argv[a], "--loop-delay") == 0 && a + 1 < argc) {
+            run.loopDelayMs = atoi(argv[++a]);
+            if (run.loopDelayMs < 0) run.loopDelayMs = 0;
+            headlessOpts = 1;
+        } else if (strcmp(argv[a], "--rate") == 0 && a + 1 < argc) {
+            run.timing.rateKps = atoi(argv[++a]);
+            if (run.timing.rateKps < 0) run.timing.rateKps = 0;
+            headlessOpts = 1;
+        } else if (strcmp(argv[a], "--dwell") == 0 && a + 1 < argc) {
+            run.timing.dwellMs = atoi(argv[++a]);
+            if (run.timing.dwellMs < 0) run.timing.dwellMs = 0;
+            headlessOpts = 1;
+        } else if (strcmp(argv[a], "--flight") == 0 && a + 1 < argc) {
+            run.timing.flightMs = atoi(argv[++a]);
+            if (run.timing.flightMs < 0) run.timing.flightMs = 0;
+            headlessOpts = 1;
+        } else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc) {
+            run.batchMs = atoi(argv[++a]);
+            if (run.batchMs < 0) run.batchMs = 0;
+            headlessOpts = 1;
+        } else if (strcmp(argv[a], "--fps") == 0 && a + 1 < argc) {
+            g_uiFps = atoi(argv[++a]);
+            if (g_uiFps < 1)   g_uiFps = 1;
+            if (g_uiFps > 120) g_uiFps = 120;
+        } else if (strcmp(argv[a], "--max-depth") == 0 && a + 1 < argc) {
+            g_maxExpandDepth = atoi(argv[++a]);
+            if (g_maxExpandDepth < 1)    g_maxExpandDepth = 1;
+            if (g_maxExpandDepth > 1024) g_maxExpandDepth = 1024;
+        } else if (strcmp(argv[a], "--backend") == 0 && a + 1 < argc) {
+            if (backend_select(argv[++a]) < 0) {
+                fprintf(stderr, "ERROR: Unknown backend '%s' (xtest, null, record, dryrun)\n", argv[a]);
+                return EXIT_USAGE;
+            }
+        } else if (strcmp(argv[a], "--dry-run") == 0 && a + 1 < argc) {
+            g_dryRunPath = argv[++a];
+            backend_select("dryrun");
+        } else if (strcmp(argv[a], "--harness") == 0) {
+            harness = 1;
+        } else if (strcmp(argv[a], "--harness-out") == 0 && a + 1 < argc) {
+            harnessOut = argv[++a];
+            harness    = 1;
+        } else if (strcmp(argv[a], "--binary-log") == 0) {
+            g_logBinary = 1;
+        } else if (strcmp(argv[a], "--decode-log") == 0 && a + 1 < argc) {
+            return decode_log_file(argv[a + 1]);
+#ifdef XTEST_BENCH
+        } else if (strcmp(argv[a], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[a], "--bench-save") == 0 && a + 1 < argc) {
+            benchSave = argv[++a];
+            bench     = 1;
+        } else if (strcmp(argv[a], "--bench-compare") == 0 && a + 1 < argc) {
+            benchCompare = argv[++a];
+            bench        = 1;
+        } else if (strcmp(argv[a], "--bench-tolerance") == 0 && a + 1 < argc) {
+            benchTolerance = atof(argv[++a]);
+        } else if (strcmp(argv[a], "--bench-floor") == 0 && a + 1 < argc) {
+            benchFloor = atof(argv[++a]);
+#endif
+        } else {
+            fprintf(stderr, "Usage: %s [--log-commit-ms N] [--log-level LEVEL] [--fps N]"
+                            " [--max-depth N] [--backend NAME]\n"
+                            "          [--dry-run FILE] [--binary-log] [--decode-log FILE]\n"
+                            "       %s --text TEXT | --script FILE [--loops N]"
+                            " [--start-delay MS] [--loop-delay MS]\n"
+                            "          [--rate KPS] [--dwell MS] [--flight MS] [--batch MS]"
+                            " [other options above]\n"
+                            "       %s --harness [--harness-out FILE] --text TEXT | --script FILE"
+                            " [run options above]\n", argv[0], argv[0], argv[0]);
+#ifdef XTEST_BENCH
+            fprintf(stderr, "       %s --bench [--bench-save FILE] [--bench-compare FILE]"
+                            " [--bench-tolerance PCT] [--bench-floor NS]\n", argv[0]);
+#endif
+            return EXIT_USAGE;
         }
     }
-    if (!g_stopRequested) {
-        add_log("SIM: All loops completed successfully.");
-    } else {
-        add_log("SIM: Stopped by user (F2).");
+#ifdef XTEST_BENCH
+    if (bench) return bench_main(benchSave, benchCompare, benchTolerance, benchFloor);
+#endif
+    int headless = headlessText != NULL;
+    if ((headlessOpts || harness) && !headless) {
+        fprintf(stderr, "ERROR: --loops, --rate, --harness, ... need --text or --script\n");
+        return EXIT_USAGE;
+    }
+    if (harness && !backend_is_xtest()) {
+        fprintf(stderr, "ERROR: --harness measures the xtest backend\n");
+        return EXIT_USAGE;
+    }
+    if (headless) {
+        // Warnings to stderr; per-key SIM lines only when asked for
+        g_logEchoLevel = LOG_LVL_WARN;
+        if (!levelSet) atomic_store(&g_logLevel, LOG_LVL_INFO);
     }
-}
 
-// ---------------------------------------------------------------------
-// main: ncurses UI. F1 => reset fields, F2 => stop. 
-// ---------------------------------------------------------------------
-int main()
-{
-    // Open logsXtest.txt in append mode
-    g_fileLog = fopen("logsXtest.txt", "a");
+    // Block SIGINT/SIGTERM before the log writer thread starts; they
+    // arrive through the signalfd instead
+    if (evloop_open_ui(!headless) < 0) {
+        fprintf(stderr, "ERROR: Could not set up epoll/timerfd/signalfd\n");
+        return EXIT_SETUP;
+    }
+
+    // Open logsXtest.txt (or .bin) in append mode
+    const char *logName = g_logBinary ? "logsXtest.bin" : "logsXtest.txt";
+    g_fileLog = fopen(logName, g_logBinary ? "ab" : "a");
     if (!g_fileLog) {
-        fprintf(stderr, "WARNING: Could not open logsXtest.txt for append.\n");
+        fprintf(stderr, "WARNING: Could not open %s for append.\n", logName);
         // We'll continue but won't log to file
     }
+    log_writer_start();
 
     // 1) Open X display
+    // (null and record need no server and fall back to a built-in keymap)
+    // The engine, the burst connection and the harness capture all use
+    // Xlib from their own threads
+    XInitThreads();
+    if (harness && xvfb_start() < 0) {
+        fprintf(stderr, "ERROR: Could not start Xvfb (is it installed?)\n");
+        log_writer_stop();
+        evloop_close(&g_uiLoop);
+        return EXIT_SETUP;
+    }
     Display *dpy = XOpenDisplay(NULL);
-    if (!dpy) {
+    if (!dpy && backend_is_xtest()) {
         fprintf(stderr, "ERROR: Could not open X display (not in X11?)\n");
-        return 1;
+        log_writer_stop();
+        evloop_close(&g_uiLoop);
+        return EXIT_SETUP;
     }
 
-    // 2) Load messages from file
+    // 2) Map messages.txt and watch it for changes (reloads are copied)
     load_messages_file("messages.txt");
+    if (!headless && message_watch_open() >= 0) {
+        evloop_add(&g_uiLoop, g_msgWatchFd, EV_INOTIFY);
+    }
+
+    // 3) Char/KeySym -> keycode table from the live keymap
+    if (dpy) {
+        keymap_build(dpy);
+    } else {
+        keymap_build_builtin();
+    }
+
+    // The harness needs the planned timeline before the real run
+    if (harness) {
+        int result = harness_plan(&run, headlessText);
+        if (result != RUN_DONE) {
+            fprintf(stderr, "ERROR: Could not plan the harness run\n");
+            free(headlessText);
+            app_shutdown(dpy);
+            return result == RUN_FAILED ? EXIT_COMPILE : EXIT_STOPPED;
+        }
+    }
 
-    // 3) Initialize ncurses
+    // From here on only the engine thread touches the X connection
+    if (engine_start(dpy) < 0) {
+        fprintf(stderr, "ERROR: Could not start the typing engine thread\n");
+        free(headlessText);
+        app_shutdown(dpy);  // no engine to stop; closes the rest
+        return EXIT_SETUP;
+    }
+
+    if (headless) {
+        run.text = headlessText;  // the engine frees it
+        int rc = harness ? harness_run(&run, harnessOut) : run_headless(&run);
+        app_shutdown(dpy);
+        return rc;
+    }
+
+    // 4) Initialize ncurses (UTF-8 fields need the user's locale)
+    setlocale(LC_CTYPE, "");
     initscr();
     start_color();
     cbreak();
@@ -554,38 +4909,37 @@ int main()
     init_pair(4, COLOR_MAGENTA, COLOR_BLACK);
     init_pair(5, COLOR_WHITE,   COLOR_BLACK);
 
-    // Fields
-    //   0: text
-    //   1: startDelay (ms)
-    //   2: loopDelay (ms)
-    //   3: loops
-    char text[256]         = {0};
-    char startDelay_str[16] = "3000";  
-    char loopDelay_str[16]  = "2000";  
-    char loops_str[16]      = "1";
-
-    int text_pos         = 0;
-    int startDelay_pos   = 4; // length("3000")
-    int loopDelay_pos    = 4; // length("2000")
-    int loops_pos        = 1; // length("1")
-    int field            = 0; // active field
-
-    add_log("DEBUG: Program started");
-    add_log("TIP: [Tab] to switch fields, [Enter] to type, Ctrl+C to quit.");
-    add_log("TIP: F1 => Reset fields, F2 => Stop mid-run.");
-    add_log("TIP: e.g. {enter}, {space}, {up:2000}, {message3}, etc.");
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        field_reset(&g_fields[f]);
+    }
+    int field = FIELD_TEXT; // active field
+
+    ui_layout();
+    nodelay(g_winPanel, TRUE);  // ui_wait_key() blocks in epoll instead
+
+    LOG_DEBUG("Program started");
+    LOG_TIP("[Tab] to switch fields, [Enter] to type, Ctrl+C to quit.");
+    LOG_TIP("F1 => Reset fields, F2 => Stop mid-run, F3 => Dump compiled plan.");
+    LOG_TIP("e.g. {enter}, {space}, {up:2000}, {message3}, etc.");
+    LOG_TIP("Rate (keys/s) overrides Flight; 0 => Dwell + Flight per key.");
+    LOG_TIP("Batch (ms) => edges due this close together share one XFlush.");
+    LOG_TIP("F4 => Cycle log level, F5 => Toggle server-paced bursts (XTest delay).");
+    LOG_TIP("F6 => Pause/resume a run; Enter mid-run => apply Rate from the next loop.");
 
     // For aggregated repeated key logging
     static int s_lastKey = -1;
     static int s_repeatCount = 0;
 
+    // Continuation bytes still to come of a UTF-8 character that did not fit
+    static int s_utf8Drop = 0;
+
     // Helper to flush repeated key logs
     void flush_key_log() {
         if (s_lastKey >= 0 && s_repeatCount > 0) {
-            add_log("DEBUG: Key pressed: %d ('%c') repeated %d time(s)",
-                    s_lastKey,
-                    (s_lastKey >= 32 && s_lastKey <= 126) ? s_lastKey : '?',
-                    s_repeatCount);
+            LOG_DEBUG("Key pressed: %d ('%c') repeated %d time(s)",
+                      s_lastKey,
+                      (s_lastKey >= 32 && s_lastKey <= 126) ? s_lastKey : '?',
+                      s_repeatCount);
         }
         s_lastKey = -1;
         s_repeatCount = 0;
@@ -593,104 +4947,86 @@ int main()
 
     // Helper to reset fields (called on F1)
     void resetAllFields() {
-        text[0] = '\0';       
-        text_pos         = 0;
-        strcpy(startDelay_str, "3000"); 
-        startDelay_pos   = 4;
-        strcpy(loopDelay_str,  "2000"); 
-        loopDelay_pos    = 4;
-        strcpy(loops_str,      "1");    
-        loops_pos        = 1;
-        add_log("F1: All fields reset to defaults.");
-    }
-
-    while (1) {
-        erase();
-
-        // Headings
-        attron(COLOR_PAIR(1));
-        mvprintw(0, 0, "XTest Keyboard Simulator (Ctrl+C to quit)");
-        attroff(COLOR_PAIR(1));
-
-        // Field labels
-        attron(COLOR_PAIR(2));
-        mvprintw(1, 0, "Text to type:");
-        attroff(COLOR_PAIR(2));
-
-        attron(COLOR_PAIR(3));
-        mvprintw(2, 0, "Start Delay (ms):");
-        attroff(COLOR_PAIR(3));
-
-        attron(COLOR_PAIR(4));
-        mvprintw(3, 0, "Loop Delay (ms):");
-        attroff(COLOR_PAIR(4));
-
-        attron(COLOR_PAIR(5));
-        mvprintw(4, 0, "Loops:");
-        attroff(COLOR_PAIR(5));
-
-        mvprintw(5, 0, "[Enter => Type, Tab => Switch, F1 => Reset, F2 => Stop]");
-
-        // Show the fields, highlight active
-        // "Text to type:" is 13 chars, plus 1 space => column 14 start
-        if (field == 0) {
-            attron(COLOR_PAIR(2) | A_REVERSE);
-            mvprintw(1, 14, "%s", text);
-            attroff(COLOR_PAIR(2) | A_REVERSE);
-        } else {
-            attron(COLOR_PAIR(2));
-            mvprintw(1, 14, "%s", text);
-            attroff(COLOR_PAIR(2));
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            field_reset(&g_fields[f]);
         }
+        add_log(LOG_LVL_INFO, "F1: All fields reset to defaults.");
+    }
 
-        if (field == 1) {
-            attron(COLOR_PAIR(3) | A_REVERSE);
-            mvprintw(2, 18, "%s", startDelay_str);
-            attroff(COLOR_PAIR(3) | A_REVERSE);
-        } else {
-            attron(COLOR_PAIR(3));
-            mvprintw(2, 18, "%s", startDelay_str);
-            attroff(COLOR_PAIR(3));
+    // Engine state, as last reported through the event queue
+    int engBusy = 0, engPaused = 0;
+
+    // Copy of the text being typed; progress token spans point into it
+    char runText[sizeof(g_fields[FIELD_TEXT].value)] = "";
+
+    int64_t framePeriod = NS_PER_SEC / g_uiFps;
+    int64_t nextFrame   = mono_ns();
+
+    while (!atomic_load(&g_quitRequested)) {
+        EngineMsg ev;
+        while (engine_queue_pop(&g_eventQueue, &ev)) {
+            switch (ev.kind) {
+            case ENG_EV_RUNNING: engBusy = 1; engPaused = 0; break;
+            case ENG_EV_PAUSED:  engPaused = 1; break;
+            case ENG_EV_RESUMED: engPaused = 0; break;
+            case ENG_EV_IDLE:
+                engBusy = 0;
+                engPaused = 0;
+                message_reclaim();  // snapshots retired mid-run
+                break;
+            default: break;
+            }
         }
 
-        if (field == 2) {
-            attron(COLOR_PAIR(4) | A_REVERSE);
-            mvprintw(3, 16, "%s", loopDelay_str);
-            attroff(COLOR_PAIR(4) | A_REVERSE);
-        } else {
-            attron(COLOR_PAIR(4));
-            mvprintw(3, 16, "%s", loopDelay_str);
-            attroff(COLOR_PAIR(4));
+        // Only what changed since the last frame gets rewritten
+        char text[192];
+        wattron(g_winHeader, COLOR_PAIR(1));
+        snprintf(text, sizeof(text),
+                 "XTest Keyboard Simulator (Ctrl+C to quit)     "
+                 "XFlush: %lu for %lu key edges, %s pacing, %lu log drops",
+                 atomic_load_explicit(&g_flushCount, memory_order_relaxed),
+                 atomic_load_explicit(&g_edgeCount, memory_order_relaxed),
+                 atomic_load(&g_serverPaced) ? "server" : "client",
+                 log_queue_dropped());
+        ui_text(g_winHeader, 0, 0, &g_uiHeader, text);
+        wattroff(g_winHeader, COLOR_PAIR(1));
+
+        ui_text(g_winPanel, 4, 0, &g_uiHint,
+                "[Enter => Type, Tab => Switch, F1 => Reset, F2 => Stop, F6 => Pause]");
+        snprintf(text, sizeof(text), "Logs (%s and above, F4 => change):",
+                 g_logLevelNames[atomic_load_explicit(&g_logLevel, memory_order_relaxed)]);
+        ui_text(g_winPanel, 5, 0, &g_uiLogTitle, text);
+
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            ui_draw_field(f, f == field);
         }
 
-        if (field == 3) {
-            attron(COLOR_PAIR(5) | A_REVERSE);
-            mvprintw(4, 6, "%s", loops_str);
-            attroff(COLOR_PAIR(5) | A_REVERSE);
-        } else {
-            attron(COLOR_PAIR(5));
-            mvprintw(4, 6, "%s", loops_str);
-            attroff(COLOR_PAIR(5));
-        }
-
-        // Logs
-        mvprintw(6, 0, "Logs:");
-        draw_logs(7);
-
-        // Put cursor in active field
-        if (field == 0) {
-            move(1, 14 + text_pos);
-        } else if (field == 1) {
-            move(2, 18 + startDelay_pos);
-        } else if (field == 2) {
-            move(3, 16 + loopDelay_pos);
-        } else {
-            move(4, 6 + loops_pos);
+        // Progress and logs follow the frame clock, however fast the
+        // engine sends keys or events
+        int64_t now = mono_ns();
+        if (!engBusy || now >= nextFrame) {
+            ui_draw_status(engBusy, runText);
+            draw_logs(g_winLogs, 0);
+            nextFrame += framePeriod;
+            if (nextFrame <= now) nextFrame = now + framePeriod;  // skip missed frames
         }
 
-        refresh();
+        // Panel goes last so the cursor ends up in the active field
+        wmove(g_winPanel, g_fields[field].row - UI_PANEL_ROW,
+              field_value_col(&g_fields[field]) + g_fields[field].pos);
+        wnoutrefresh(g_winHeader);
+        wnoutrefresh(g_winStatus);
+        wnoutrefresh(g_winLogs);
+        wnoutrefresh(g_winPanel);
+        doupdate();
 
-        int ch = getch();
+        int ch = ui_wait_key(g_winPanel, engBusy ? nextFrame : -1);
+        if (ch == ERR) break;
+        if (ch == UI_NO_KEY) continue;
+        if (ch == KEY_RESIZE) {
+            ui_layout();
+            continue;
+        }
 
         // Aggregated repeated key logging
         if (ch == s_lastKey) {
@@ -701,69 +5037,102 @@ int main()
             s_repeatCount = 1;
         }
 
+        UiField *active = &g_fields[field];
+
         // Handle keys
         if (ch == KEY_F(1)) {
             resetAllFields();
         }
         else if (ch == KEY_F(2)) {
-            // If currently typing, it sets g_stopRequested
-            add_log("F2: Stop requested => Will abort typing if in progress.");
-            g_stopRequested = 1;
+            add_log(LOG_LVL_INFO, "F2: Stop requested => Will abort typing if in progress.");
+            EngineMsg m = { .kind = ENG_CMD_STOP };
+            engine_send(&m);
+        }
+        else if (ch == KEY_F(3)) {
+            EngineMsg m = { .kind   = ENG_CMD_DUMP,
+                            .timing = timing_from_fields(),
+                            .text   = strdup(g_fields[FIELD_TEXT].value) };
+            engine_send(&m);
+        }
+        else if (ch == KEY_F(4)) {
+            int level = (atomic_load(&g_logLevel) + 1) % LOG_LVL_COUNT;
+            atomic_store(&g_logLevel, level);
+            // Say so even if the new threshold would hide an INFO line
+            add_log_always(LOG_LVL_INFO, "F4: Log level => %s and above", g_logLevelNames[level]);
+        }
+        else if (ch == KEY_F(5)) {
+            int paced = !atomic_load(&g_serverPaced);
+            atomic_store(&g_serverPaced, paced);
+            add_log(LOG_LVL_INFO, "F5: Pacing => %s (from the next loop)",
+                    paced ? "server (XTest delay)" : "client");
+        }
+        else if (ch == KEY_F(6)) {
+            if (engBusy) {
+                add_log(LOG_LVL_INFO, "F6: %s requested", engPaused ? "Resume" : "Pause");
+                EngineMsg m = { .kind = ENG_CMD_PAUSE };
+                engine_send(&m);
+            }
         }
         else if (ch == '\t') {
-            field = (field + 1) % 4;
+            active->dirty = 1;  // loses its highlight
+            field = (field + 1) % FIELD_COUNT;
+            g_fields[field].dirty = 1;
+        }
+        else if (ch == '\n' && engBusy) {
+            // Mid-run, Enter only changes the rate
+            EngineMsg m = { .kind = ENG_CMD_RATE, .timing = timing_from_fields() };
+            engine_send(&m);
         }
         else if (ch == '\n') {
             // Convert numeric fields
-            int start_ms = atoi(startDelay_str);
-            int loop_ms  = atoi(loopDelay_str);
-            int loops    = atoi(loops_str);
+            int start_ms = field_int(FIELD_START_DELAY);
+            int loop_ms  = field_int(FIELD_LOOP_DELAY);
+            int loops    = field_int(FIELD_LOOPS);
 
             if (start_ms < 0) start_ms = 0;
             if (loop_ms < 0)  loop_ms  = 0;
             if (loops < 1)    loops    = 1;
 
-            simulate_typing(dpy, text, loops, start_ms, loop_ms);
+            EngineMsg m = { .kind         = ENG_CMD_START,
+                            .loops        = loops,
+                            .startDelayMs = start_ms,
+                            .loopDelayMs  = loop_ms,
+                            .batchMs      = field_int(FIELD_BATCH),
+                            .timing       = timing_from_fields(),
+                            .text         = strdup(g_fields[FIELD_TEXT].value) };
+            if (engine_send(&m) == 0) {
+                engBusy = 1;  // until ENG_EV_IDLE says otherwise
+                snprintf(runText, sizeof(runText), "%s", g_fields[FIELD_TEXT].value);
+            }
         }
         else if (ch == KEY_BACKSPACE || ch == 127) {
-            // backspace in active field
-            if (field == 0 && text_pos > 0) {
-                text[--text_pos] = '\0';
-            }
-            else if (field == 1 && startDelay_pos > 0) {
-                startDelay_str[--startDelay_pos] = '\0';
-            }
-            else if (field == 2 && loopDelay_pos > 0) {
-                loopDelay_str[--loopDelay_pos] = '\0';
-            }
-            else if (field == 3 && loops_pos > 0) {
-                loops_str[--loops_pos] = '\0';
+            // backspace in active field, a whole UTF-8 character at a time
+            if (active->pos > 0) {
+                do {
+                    active->pos--;
+                } while (active->pos > 0
+                         && ((unsigned char)active->value[active->pos] & 0xc0) == 0x80);
+                active->value[active->pos] = '\0';
+                active->dirty = 1;
             }
         }
-        else if (ch >= ' ' && ch <= '~') {
-            // For text, accept all printable chars
+        else if ((ch >= ' ' && ch <= '~') || (ch >= 0x80 && ch <= 0xff)) {
+            // For text, accept all printable chars and UTF-8 bytes
             // For numeric fields, digits only
-            if (field == 0 && text_pos < (int)(sizeof(text) - 1)) {
-                text[text_pos++] = (char)ch;
-                text[text_pos] = '\0';
-            }
-            else if (field == 1 && startDelay_pos < (int)(sizeof(startDelay_str) - 1)
-                     && (ch >= '0' && ch <= '9'))
-            {
-                startDelay_str[startDelay_pos++] = (char)ch;
-                startDelay_str[startDelay_pos] = '\0';
-            }
-            else if (field == 2 && loopDelay_pos < (int)(sizeof(loopDelay_str) - 1)
-                     && (ch >= '0' && ch <= '9'))
-            {
-                loopDelay_str[loopDelay_pos++] = (char)ch;
-                loopDelay_str[loopDelay_pos] = '\0';
-            }
-            else if (field == 3 && loops_pos < (int)(sizeof(loops_str) - 1)
-                     && (ch >= '0' && ch <= '9'))
+            // A lead byte is only taken if its whole character fits, so
+            // maxLen never splits a UTF-8 sequence
+            int need = ch < 0x80 ? 1 : ch >= 0xf0 ? 4 : ch >= 0xe0 ? 3 : ch >= 0xc0 ? 2 : 0;
+            if (need == 0 && s_utf8Drop > 0) {
+                s_utf8Drop--;
+            } else if (need > 0 && active->pos + need > active->maxLen) {
+                s_utf8Drop = need - 1;
+            } else if (active->pos < active->maxLen
+                       && (!active->numeric || (ch >= '0' && ch <= '9')))
             {
-                loops_str[loops_pos++] = (char)ch;
-                loops_str[loops_pos] = '\0';
+                if (need > 0) s_utf8Drop = 0;
+                active->value[active->pos++] = (char)ch;
+                active->value[active->pos] = '\0';
+                active->dirty = 1;
             }
             // else ignore
         }
@@ -773,19 +5142,7 @@ int main()
     flush_key_log();
     endwin();
 
-    // Cleanup messages
-    for (int i = 0; i < g_messageCount; i++) {
-        free(g_messages[i]);
-        g_messages[i] = NULL;
-    }
-
-    // Close the log file if open
-    if (g_fileLog) {
-        fclose(g_fileLog);
-        g_fileLog = NULL;
-    }
-
-    XCloseDisplay(dpy);
-    return 0;
+    app_shutdown(dpy);
+    return EXIT_DONE;
 }
 